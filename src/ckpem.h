@@ -39,8 +39,6 @@
 #ifndef CKPEM_H
 #define CKPEM_H
 
-#include "list.h"
-
 #define USE_UTIL_DIRECTLY
 #include <utilrename.h>
 
@@ -108,6 +106,10 @@ typedef struct pemRawObjectStr pemRawObject;
 
 /*
  * common values needed for both bare keys and cert referenced keys.
+ *
+ * The DER encoding of the key is stored only once (privateKey).  The RSA
+ * components are decoded from it on demand (lpk) and the NSSItems below only
+ * point into the arena of lpk, they do not own any memory.
  */
 struct pemKeyParamsStr {
   NSSItem         modulus;
@@ -120,7 +122,13 @@ struct pemKeyParamsStr {
   NSSItem         coefficient;
   /* TODO: split algoritm-specific data out */
   SECItem         *privateKey;
-  SECItem         *privateKeyOrig; /* deep copy of privateKey until decrypted */
+  NSSLOWKEYPrivateKey *lpk;     /* decoded privateKey, NULL until needed */
+  /* identify the key DER as it was loaded (privateKey is decrypted in place
+   * on login) so that we can recognize the same key being added again */
+  unsigned int    fingerprintLen;
+  unsigned char   fingerprint[SHA1_LENGTH];
+  /* copy of the modulus and public exponent if known on load, modulus and
+   * exponent then point here instead of into lpk */
   void            *pubKey;
 };
 typedef struct pemKeyParamsStr pemKeyParams;
@@ -138,17 +146,21 @@ typedef struct pemKeyObjectStr pemKeyObject;
 
 /*
  * Certificate and certificate referenced keys.
+ *
+ * Only the DER encoding is retained when the object is loaded, after a
+ * check that the fields can be found.  Subject, issuer and serial are
+ * extracted on first use by pem_ParseCertFields() and point into derCert.
  */
 struct pemCertObjectStr {
   const char      *certStore;
   NSSItem         label;
+  PRBool          fieldsParsed;
   NSSItem         subject;
   NSSItem         issuer;
   NSSItem         serial;
   NSSItem         derCert;
   unsigned char   sha1_hash[SHA1_LENGTH];
   unsigned char   md5_hash[MD5_LENGTH];
-  pemKeyParams key;
 };
 typedef struct pemCertObjectStr pemCertObject;
 
@@ -160,12 +172,21 @@ struct pemTrustObjectStr {
 };
 typedef struct pemTrustObjectStr pemTrustObject;
 
+/* module-specific object classes */
+#define CKO_PEM                 (CKO_VENDOR_DEFINED | 0x50454D00) /* "PEM" */
+#define CKO_PEM_STATS           (CKO_PEM + 1)
+
+/* module-specific attributes, CKA_PEM_TRACE is the trace dump of ptrace.c */
+#define CKA_PEM                 (CKA_VENDOR_DEFINED | 0x50454D00) /* "PEM" */
+#define CKA_PEM_TRACE           (CKA_PEM + 1)
+
 typedef enum {
   pemAll = -1, /* matches all types */
   pemRaw,
   pemCert,
   pemBareKey,
-  pemTrust
+  pemTrust,
+  pemStats
 } pemObjectType;
 
 typedef struct pemInternalObjectStr pemInternalObject;
@@ -182,29 +203,17 @@ struct pemObjectListItemStr {
 /*
  * all the various types of objects are abstracted away in cobject and
  * cfind as pemInternalObjects.
+ *
+ * The fields needed to skip an object while searching are also kept in the
+ * pemHotObject of the object in its slot store, so that searches do not need
+ * to touch the object unless it is a likely match.
  */
 struct pemInternalObjectStr {
   pemObjectType type;
-  union {
-    pemRawObject    raw;
-    pemCertObject   cert;
-    pemKeyObject    key;
-    pemTrustObject  trust;
-  } u;
   CK_OBJECT_CLASS objClass;
-  NSSItem         hashKey;
-  NSSItem         id;
-  long            objid;
-  unsigned char   hashKeyData[128];
-  SECItem         *derCert;
-  char            *nickname;
-  NSSCKMDObject   mdObject;
   CK_SLOT_ID      slotID;
   int             refCount;
 
-  /* all internal objects are linked in a global list */
-  struct list_head gl_list;
-
   /* we represent sparse array as list but keep its elements indexed */
   long            arrayIdx;
 
@@ -214,15 +223,71 @@ struct pemInternalObjectStr {
   /* If list != NULL, the object contains no useful data except of the list
    * of slave objects */
   pemObjectListItem *list;
+
+  NSSItem         id;
+  PRBool          idFromKey;    /* id is the SHA-1 hash of the public key */
+
+  /* next object in the same bucket of the ID index, see pinst.c */
+  pemInternalObject *idNext;
+
+  /* the same for the content index, see AddObjectIfNeeded() */
+  pemInternalObject *contentNext;
+  PRUint32        contentHash;
+
+  SECItem         *derCert;
+  char            *nickname;
+  union {
+    pemRawObject    raw;
+    pemCertObject   cert;
+    pemKeyObject    key;
+    pemTrustObject  trust;
+  } u;
+  NSSCKMDObject   mdObject;
+};
+
+/*
+ * Search summary of an object in a slot store.  io is NULL once the object
+ * has been destroyed, such holes are squeezed out from time to time.
+ */
+typedef struct pemHotObjectStr {
+  long              arrayIdx;
+  pemInternalObject *io;
+  CK_OBJECT_CLASS   objClass;
+  pemObjectType     type;
+  PRUint32          idHash;     /* pem_HashId() of io->id */
+} pemHotObject;
+
+/*
+ * Objects of one slot.  Searches, logins and duplicate checks only ever look
+ * at the objects of one slot, so they only walk its array.
+ */
+struct pemSlotStoreStr {
+  pemHotObject     *objs;       /* in the order of arrayIdx */
+  long             nentries;    /* used entries of objs, holes included */
+  long             capacity;
+  long             nobjs;       /* live objects */
+  PRUint32         generation;  /* changed whenever holes are squeezed out */
+  pemInternalObject *lastCert;  /* non-CA certificate added or re-used last */
+  pemInternalObject *unpairedKey; /* key with unknown public key, no cert */
 };
+typedef struct pemSlotStoreStr pemSlotStore;
 
-NSS_EXTERN_DATA struct list_head pem_objs;
 NSS_EXTERN_DATA long pem_nobjs;
 NSS_EXTERN_DATA int token_needsLogin[];
 NSS_EXTERN_DATA NSSCKMDSlot *lastEventSlot;
 
+/* private data of a session, NSSCKMDSession.etc */
+struct pemSessionStr {
+  NSSCKFWSession  *fwSession;
+  struct pemFOStr *freeFinds;   /* states of finished searches, see pfind.c */
+  int             nfreeFinds;
+};
+typedef struct pemSessionStr pemSession;
+
 struct pemTokenStr {
   PRBool          logged_in;
+  char            label[32];            /* CK_TOKEN_INFO.label */
+  char            slotDescription[64];  /* CK_SLOT_INFO.slotDescription */
 };
 typedef struct pemTokenStr pemToken;
 
@@ -250,12 +315,15 @@ pem_CreateSession
 NSS_EXTERN NSSCKMDFindObjects *
 pem_FindObjectsInit
 (
+  NSSCKMDSession *mdSession,
   NSSCKFWSession *fwSession,
   CK_ATTRIBUTE_PTR pTemplate,
   CK_ULONG ulAttributeCount,
   CK_RV *pError
 );
 
+void pem_DestroyFindObjectsCache(pemSession *session);
+
 NSS_EXTERN NSSCKMDObject *
 pem_CreateMDObject
 (
@@ -269,6 +337,13 @@ pem_CreateMDObject
 /* Read DER encoded data from a PEM file or a binary (der-encoded) file. */
 int ReadDERFromFile(SECItem ***derlist, char *filename, int *cipher,
                     char **ivstring, PRBool certsonly);
+int pem_ReadDERFromBuffer(SECItem ***derlist, const unsigned char *buf,
+                          unsigned int len, int *cipher, char **ivstring,
+                          PRBool certsonly);
+void FreeDERList(SECItem **derlist, int count);
+void pem_FileCacheBegin(void);
+void pem_FileCacheEnd(void);
+void pem_FilePrefetch(const char **names, int count);
 
 /* Fetch an attribute of the specified type. */
 const NSSItem * pem_FetchAttribute ( pemInternalObject *io, CK_ATTRIBUTE_TYPE type, CK_RV *pError);
@@ -276,11 +351,23 @@ const NSSItem * pem_FetchAttribute ( pemInternalObject *io, CK_ATTRIBUTE_TYPE ty
 /* Populate modulus and public exponent of the given internal object */
 CK_RV pem_PopulateModulusExponent(pemInternalObject *io);
 
+/* Compute fingerprint of the DER encoding of a private key */
+SECStatus pem_FingerprintKey(pemKeyParams *kp, const SECItem *keyDER);
+CK_RV pem_SetPublicKey(pemKeyParams *kp, const SECItem *modulus,
+                       const SECItem *exponent);
+
+/* Drop the decoded key components, wiping them from memory */
+void pem_ForgetKeyComponents(pemKeyParams *kp);
+
+/* Wipe and free all key material held by the given key params */
+void pem_DestroyKeyParams(pemKeyParams *kp);
+
 /* Create a pem module object */
 NSSCKMDObject * pem_CreateObject(NSSCKFWInstance *fwInstance, NSSCKFWSession *fwSession, NSSCKMDToken *mdToken, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, CK_RV *pError);
 
 /* Create a new pem module slot */
-NSSCKMDSlot *pem_NewSlot( NSSCKFWInstance *fwInstance, CK_RV *pError);
+NSSCKMDSlot *pem_NewSlot( NSSCKFWInstance *fwInstance, CK_SLOT_ID slotID,
+                          CK_RV *pError);
 
 typedef void* (*DynPtrListAllocFunction) (size_t bytes);
 typedef void* (*DynPtrListReallocFunction) (void *ptr, size_t bytes);
@@ -302,24 +389,144 @@ void* pem_AddToDynPtrList(DynPtrList *dpl, char *ptr);
 
 PRBool pem_ParseString(const char *inputstring, const char delimiter,
                        DynPtrList *returnedstrings);
+char *pem_GetParameter(const char *params, const char *name);
 
 pemInternalObject *
 AddObjectIfNeeded(CK_OBJECT_CLASS objClass, pemObjectType type,
-                  SECItem *certDER, SECItem *keyDER, const char *filename, long objid,
-                  CK_SLOT_ID slotID, PRBool *pAdded);
+                  SECItem *certDER, SECItem *keyDER, const char *filename,
+                  CK_SLOT_ID slotID, PRBool cacert, PRBool *pAdded);
 
+CK_RV AddCertificate(char *certfile, char *keyfile, PRBool cacert,
+                     CK_SLOT_ID slotID);
+
+pemSlotStore *pem_GetSlotStore (CK_SLOT_ID slotID, PRBool create);
+long pem_SlotStoreSeek (const pemSlotStore *store, long arrayIdx);
+PRUint32 pem_HashId (const NSSItem *id);
 void pem_DestroyInternalObject (pemInternalObject *io);
+void pem_FreeInternalObject (pemInternalObject *io);
+void pem_UnindexObject (pemInternalObject *io);
+pemInternalObject *pem_FindObjectById (const NSSItem *id, CK_SLOT_ID slotID,
+                                       pemObjectType type);
+pemInternalObject *pem_FindUnpairedCert (CK_SLOT_ID slotID);
+pemInternalObject *pem_GetStatsObject (CK_SLOT_ID slotID);
+void pem_DestroyStatsObjects (void);
+
+/* Extract issuer, serial and subject of a cert or trust object if needed */
+SECStatus pem_ParseCertFields(pemInternalObject *io);
 
 
 /* prsa.c */
 unsigned int pem_PrivateModulusLen(NSSLOWKEYPrivateKey *privk);
 
+/* pfilter.c */
+void pem_FilterAdd(pemInternalObject *io);
+void pem_FilterRemove(pemInternalObject *io);
+PRBool pem_FilterMayMatch(CK_SLOT_ID slotID, CK_OBJECT_CLASS objClass,
+                          const CK_ATTRIBUTE *pTemplate,
+                          CK_ULONG ulAttributeCount);
+void pem_FilterReset(void);
+
+/* pcapath.c */
+CK_RV pem_CapathAdd(const char *dir, CK_SLOT_ID slotID);
+void pem_CapathLoad(CK_SLOT_ID slotID, const CK_ATTRIBUTE *pTemplate,
+                    CK_ULONG ulAttributeCount);
+void pem_CapathReset(void);
+
+/* pblob.c */
+SECItem *pem_BlobGet(const SECItem *der);
+void pem_BlobRelease(SECItem *item);
+void pem_BlobReset(void);
+
+/* psnap.c */
+
+/* digest of the contents of a source file, computed once per load */
+typedef struct pemSrcDigestStr {
+  PRFileInfo64     info;        /* of the source as hashed */
+  unsigned char    digest[SHA256_LENGTH];
+  PRBool           valid;
+} pemSrcDigest;
+
+int pem_SnapshotLoad(SECItem ***derlist, const char *filename,
+                     pemSrcDigest *src);
+void pem_SnapshotStore(SECItem **derlist, int count, const char *filename,
+                       const PRFileInfo64 *srcInfo,
+                       const unsigned char *srcDigest);
+PRBool pem_SnapshotOwns(const void *data);
+void pem_SnapshotRelease(void);
+PRBool pem_SnapshotEnabled(void);
+
 /* ptoken.c */
-NSSCKMDToken * pem_NewToken(NSSCKFWInstance *fwInstance, CK_RV *pError);
+NSSCKMDToken * pem_NewToken(NSSCKFWInstance *fwInstance, CK_SLOT_ID slotID,
+                             CK_RV *pError);
 
-/* util.c */
-void open_nss_pem_log();
-/* no close_log */
-void plog(const char *fmt, ...);
+/* pstats.c */
+
+/* keep in sync with pem_statNames */
+typedef enum {
+  pemStatInitialize,
+  pemStatFindObjectsInit,
+  pemStatGetAttribute,
+  pemStatLogin,
+  pemStatSignInit,
+  pemStatSign,
+  pemStatCount
+} pemStatOp;
+
+void pem_StatsRecord(pemStatOp op, PRIntervalTime start);
+PRUint32 pem_StatsReportSize(void);
+void pem_StatsReport(char *buf);
+void pem_StatsFinalize(void);
+
+/* ptrace.c */
+
+/* trace categories, see trace= and NSS_PEM_TRACE */
+#define PEM_TRACE_LOG           0x0001  /* formatted plog() messages */
+#define PEM_TRACE_INIT          0x0002
+#define PEM_TRACE_IO            0x0004
+#define PEM_TRACE_OBJECT        0x0008
+#define PEM_TRACE_ATTR          0x0010
+#define PEM_TRACE_FIND          0x0020
+#define PEM_TRACE_MATCH         0x0040
+#define PEM_TRACE_SESSION       0x0080
+#define PEM_TRACE_CRYPTO        0x0100
+
+/* keep in sync with pem_traceEventNames, arguments are given in comments */
+typedef enum {
+  pemTraceInitialize,           /* number of config entries, rv */
+  pemTraceFinalize,             /* number of objects */
+  pemTraceReadFile,             /* certsonly, number of objects read */
+  pemTraceObjectCreate,         /* arrayIdx, objClass */
+  pemTraceObjectReuse,          /* arrayIdx, refCount */
+  pemTraceObjectDestroy,        /* arrayIdx, objClass */
+  pemTraceFindInit,             /* slotID, number of attributes */
+  pemTraceFindMatch,            /* arrayIdx, (attribute type << 1) | match */
+  pemTraceFindDone,             /* slotID, number of objects found */
+  pemTraceAttrFetch,            /* arrayIdx, attribute type */
+  pemTraceLogin,                /* slotID, rv */
+  pemTraceCryptoInit            /* arrayIdx of the key, rv */
+} pemTraceEvent;
+
+NSS_EXTERN_DATA PRUint32 pem_traceMask;
+
+void open_nss_pem_log(const char *params);
+void close_nss_pem_log();
+void pem_LogPrint(const char *fmt, ...);
+void pem_TraceEvent(pemTraceEvent event, PRUint64 arg1, PRUint64 arg2);
+PRUint32 pem_TraceReportSize(void);
+PRUint32 pem_TraceReport(char *buf, PRUint32 size);
+void pem_TraceDump(PRFileDesc *fd);
+
+/* record an event if its category is enabled, the arguments are only
+ * evaluated in that case */
+#define pem_Trace(category, event, arg1, arg2) do {                 \
+    if (pem_traceMask & (category))                                 \
+        pem_TraceEvent((event), (PRUint64) (arg1), (PRUint64) (arg2)); \
+} while (0)
+
+/* formatted message, only formatted if the "log" category is enabled */
+#define plog(...) do {                                              \
+    if (pem_traceMask & PEM_TRACE_LOG)                              \
+        pem_LogPrint(__VA_ARGS__);                                  \
+} while (0)
 
 #endif /* CKPEM_H */
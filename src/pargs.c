@@ -112,3 +112,32 @@ pem_ParseString(const char *inputstring, const char delimiter,
     return PR_TRUE;
 }
 
+
+/*
+ * Returns a copy of the value of the first name=value entry of the
+ * space-delimited parameter string params, or NULL if there is none.  The
+ * returned string can be passed to NSS_ZFreeIf.
+ */
+char *
+pem_GetParameter(const char *params, const char *name)
+{
+    size_t namelen;
+
+    if (!params || !name) {
+        return NULL;
+    }
+    namelen = strlen(name);
+
+    while (*params) {
+        size_t len = strcspn(params, " ");
+
+        if (len > namelen && '=' == params[namelen]
+                && !strncmp(params, name, namelen)) {
+            return pem_StrNdup(params + namelen + 1, len - namelen - 1);
+        }
+
+        params += len;
+        params += strspn(params, " ");
+    }
+    return NULL;
+}
@@ -0,0 +1,198 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Netscape security libraries.
+ *
+ * The Initial Developer of the Original Code is
+ * Netscape Communications Corporation.
+ * Portions created by the Initial Developer are Copyright (C) 1994-2000
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Rob Crittenden (rcritten@redhat.com)
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include "ckpem.h"
+
+#include <nspr.h>
+
+/*
+ * pblob.c
+ *
+ * Content-addressed store of the DER encodings of certificates for the
+ * "PEM objects" cryptoki module.
+ *
+ * A certificate loaded into several slots, its trust object and the keys
+ * that come with it all refer to the same encoding.  Instead of each object
+ * keeping its own copy, objects share one reference counted blob per
+ * distinct encoding.  The blob borrows the encoding from a snapshot if it
+ * comes from one (see psnap.c), otherwise the encoding is copied once.
+ *
+ * A blob is freed along with its last reference.
+ */
+
+typedef struct pemBlobStr {
+    SECItem     item;           /* what objects point to, must be first */
+    PRUint32    refCount;
+    PRUint32    hash;
+    struct pemBlobStr *next;    /* in the same bucket */
+} pemBlob;
+
+static pemBlob **pem_blobBuckets;
+static PRUint32 pem_blobMask;   /* number of buckets - 1 */
+static PRUint32 pem_blobEntries;
+
+static PRUint32
+pem_BlobHash(const SECItem *der)
+{
+    NSSItem item;
+
+    item.data = der->data;
+    item.size = der->len;
+    return pem_HashId(&item);
+}
+
+/* keep the load factor at most 1 after one more entry */
+static PRBool
+pem_BlobReserve(void)
+{
+    pemBlob **old = pem_blobBuckets;
+    PRUint32 oldCount = old ? pem_blobMask + 1 : 0;
+    PRUint32 count = oldCount ? oldCount : 64;
+    PRUint32 i;
+
+    if (old && pem_blobEntries + 1 < oldCount)
+        return PR_TRUE;
+
+    while (count <= pem_blobEntries + 1)
+        count <<= 1;
+
+    pem_blobBuckets = NSS_ZNEWARRAY(NULL, pemBlob *, count);
+    if (!pem_blobBuckets) {
+        pem_blobBuckets = old;
+        return old != NULL;
+    }
+    pem_blobMask = count - 1;
+
+    for (i = 0; i < oldCount; i++) {
+        pemBlob *b = old[i];
+        while (b) {
+            pemBlob *next = b->next;
+            b->next = pem_blobBuckets[b->hash & pem_blobMask];
+            pem_blobBuckets[b->hash & pem_blobMask] = b;
+            b = next;
+        }
+    }
+    NSS_ZFreeIf(old);
+    return PR_TRUE;
+}
+
+/*
+ * Return the shared copy of der with one more reference, to be released by
+ * pem_BlobRelease().  The returned item must not be modified.
+ */
+SECItem *
+pem_BlobGet(const SECItem *der)
+{
+    PRUint32 hash = pem_BlobHash(der);
+    PRBool borrow;
+    pemBlob *b;
+
+    if (pem_blobBuckets) {
+        for (b = pem_blobBuckets[hash & pem_blobMask]; b; b = b->next) {
+            if (b->hash == hash && SECEqual == SECITEM_CompareItem(&b->item,
+                                                                   der)) {
+                b->refCount++;
+                return &b->item;
+            }
+        }
+    }
+
+    if (!pem_BlobReserve())
+        return NULL;
+
+    borrow = der->len && pem_SnapshotOwns(der->data);
+    b = NSS_ZAlloc(NULL, sizeof *b + (borrow ? 0 : der->len));
+    if (!b)
+        return NULL;
+
+    if (borrow) {
+        b->item.data = der->data;
+    } else {
+        b->item.data = (unsigned char *) (b + 1);
+        memcpy(b->item.data, der->data, der->len);
+    }
+    b->item.len = der->len;
+    b->refCount = 1;
+    b->hash = hash;
+    b->next = pem_blobBuckets[hash & pem_blobMask];
+    pem_blobBuckets[hash & pem_blobMask] = b;
+    pem_blobEntries++;
+    return &b->item;
+}
+
+void
+pem_BlobRelease(SECItem *item)
+{
+    pemBlob *b = (pemBlob *) item;
+    pemBlob **pp;
+
+    if (!b || --b->refCount)
+        return;
+
+    for (pp = &pem_blobBuckets[b->hash & pem_blobMask]; *pp;
+         pp = &(*pp)->next) {
+        if (*pp == b) {
+            *pp = b->next;
+            pem_blobEntries--;
+            break;
+        }
+    }
+
+    /* wipes the copy, if any, along with the header */
+    NSS_ZFreeIf(b);
+}
+
+/* free the blobs still referenced, once the objects are gone */
+void
+pem_BlobReset(void)
+{
+    PRUint32 i;
+
+    for (i = 0; pem_blobBuckets && i <= pem_blobMask; i++) {
+        pemBlob *b = pem_blobBuckets[i];
+
+        while (b) {
+            pemBlob *next = b->next;
+            NSS_ZFreeIf(b);
+            b = next;
+        }
+    }
+    NSS_ZFreeIf(pem_blobBuckets);
+    pem_blobBuckets = NULL;
+    pem_blobMask = 0;
+    pem_blobEntries = 0;
+}
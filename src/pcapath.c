@@ -0,0 +1,591 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Netscape security libraries.
+ *
+ * The Initial Developer of the Original Code is
+ * Netscape Communications Corporation.
+ * Portions created by the Initial Developer are Copyright (C) 1994-2000
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Rob Crittenden (rcritten@redhat.com)
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include "ckpem.h"
+
+#include <nspr.h>
+
+#include <blapi.h>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+/*
+ * pcapath.c
+ *
+ * Hashed directories of CA certificates ("capath=DIR" in the module
+ * parameters), laid out like the CApath of OpenSSL: every file is named
+ * after the subject of the certificate in it, as HHHHHHHH.N with the hash of
+ * X509_NAME_hash() and N counting certificates of equal hash from 0.
+ *
+ * Only the hashes of the file names are read at initialization.  The
+ * certificates are loaded into the slot of the directory when a search asks
+ * for their subject (CKA_SUBJECT) for the first time.  A search by issuer
+ * (CKA_ISSUER) loads the certificates whose subject is that issuer, which
+ * are the (self-signed) roots a CA store consists of.  Certificates not
+ * looked up this way are never loaded.
+ */
+
+typedef struct pemCapathStr {
+    char        *dir;
+    CK_SLOT_ID  slotID;
+    PRUint32    *hashes;        /* sorted, without duplicates */
+    PRUint8     *loaded;        /* per hash, the files have been read */
+    int         nhashes;
+    struct pemCapathStr *next;
+} pemCapath;
+
+static pemCapath *pem_capaths;
+
+/* buffer for the canonical encoding of a name */
+typedef struct pemNameBufStr {
+    unsigned char *data;
+    unsigned int len;
+    unsigned int size;
+    PRBool      error;
+} pemNameBuf;
+
+static void
+pem_NameBufPut(pemNameBuf *b, const void *data, unsigned int len)
+{
+    if (b->error)
+        return;
+    if (b->len + len > b->size) {
+        unsigned int size = b->size ? b->size : 256;
+        unsigned char *p;
+
+        while (size < b->len + len)
+            size <<= 1;
+        p = PORT_Realloc(b->data, size);
+        if (!p) {
+            b->error = PR_TRUE;
+            return;
+        }
+        b->data = p;
+        b->size = size;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+/* append the tag and the DER length of an element */
+static void
+pem_NameBufPutTL(pemNameBuf *b, unsigned char tag, unsigned int len)
+{
+    unsigned char tl[6];
+    unsigned int n = 0;
+
+    tl[n++] = tag;
+    if (len < 0x80) {
+        tl[n++] = len;
+    } else if (len < 0x100) {
+        tl[n++] = 0x81;
+        tl[n++] = len;
+    } else if (len < 0x10000) {
+        tl[n++] = 0x82;
+        tl[n++] = len >> 8;
+        tl[n++] = len;
+    } else {
+        tl[n++] = 0x84;
+        tl[n++] = len >> 24;
+        tl[n++] = len >> 16;
+        tl[n++] = len >> 8;
+        tl[n++] = len;
+    }
+    pem_NameBufPut(b, tl, n);
+}
+
+/* append the UTF-8 encoding of the character c */
+static void
+pem_NameBufPutUTF8(pemNameBuf *b, PRUint32 c)
+{
+    unsigned char u[4];
+    unsigned int n;
+
+    if (c < 0x80) {
+        u[0] = c;
+        n = 1;
+    } else if (c < 0x800) {
+        u[0] = 0xc0 | (c >> 6);
+        u[1] = 0x80 | (c & 0x3f);
+        n = 2;
+    } else if (c < 0x10000) {
+        u[0] = 0xe0 | (c >> 12);
+        u[1] = 0x80 | ((c >> 6) & 0x3f);
+        u[2] = 0x80 | (c & 0x3f);
+        n = 3;
+    } else {
+        u[0] = 0xf0 | ((c >> 18) & 0x07);
+        u[1] = 0x80 | ((c >> 12) & 0x3f);
+        u[2] = 0x80 | ((c >> 6) & 0x3f);
+        u[3] = 0x80 | (c & 0x3f);
+        n = 4;
+    }
+    pem_NameBufPut(b, u, n);
+}
+
+/*
+ * Read the tag and length of the DER element at *p, which must fit before
+ * end, and leave *p at its contents.
+ */
+static PRBool
+pem_GetTagLength(const unsigned char **p, const unsigned char *end,
+                 unsigned char *tag, unsigned int *len)
+{
+    const unsigned char *q = *p;
+    unsigned int n;
+
+    if (end - q < 2)
+        return PR_FALSE;
+    *tag = *q++;
+    if (*q < 0x80) {
+        n = *q++;
+    } else {
+        int k = *q++ & 0x7f;
+
+        if (k == 0 || k > 4 || end - q < k)
+            return PR_FALSE;
+        for (n = 0; k; k--)
+            n = (n << 8) | *q++;
+    }
+    if ((unsigned int) (end - q) < n)
+        return PR_FALSE;
+    *p = q;
+    *len = n;
+    return PR_TRUE;
+}
+
+static PRBool
+pem_IsSpace(unsigned char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/*
+ * Append the canonical form of a string value the way OpenSSL hashes it:
+ * converted to UTF8String, without leading and trailing white space, inner
+ * white space collapsed to single spaces and ASCII letters in lower case.
+ * Values of other types are appended as they are.
+ */
+static void
+pem_PutCanonicalValue(pemNameBuf *b, unsigned char tag,
+                      const unsigned char *value, unsigned int len)
+{
+    pemNameBuf utf8;
+    unsigned char *from, *to, *end;
+    unsigned int i;
+
+    memset(&utf8, 0, sizeof utf8);
+    switch (tag) {
+    case 0x0c:                  /* UTF8String */
+    case 0x13:                  /* PrintableString */
+    case 0x16:                  /* IA5String */
+    case 0x1a:                  /* VisibleString */
+        pem_NameBufPut(&utf8, value, len);
+        break;
+    case 0x14:                  /* T61String, taken as Latin-1 */
+        for (i = 0; i < len; i++)
+            pem_NameBufPutUTF8(&utf8, value[i]);
+        break;
+    case 0x1e:                  /* BMPString */
+        if (len % 2) {
+            b->error = PR_TRUE;
+            return;
+        }
+        for (i = 0; i < len; i += 2)
+            pem_NameBufPutUTF8(&utf8, (value[i] << 8) | value[i + 1]);
+        break;
+    case 0x1c:                  /* UniversalString */
+        if (len % 4) {
+            b->error = PR_TRUE;
+            return;
+        }
+        for (i = 0; i < len; i += 4)
+            pem_NameBufPutUTF8(&utf8, ((PRUint32) value[i] << 24)
+                               | (value[i + 1] << 16) | (value[i + 2] << 8)
+                               | value[i + 3]);
+        break;
+    default:
+        pem_NameBufPutTL(b, tag, len);
+        pem_NameBufPut(b, value, len);
+        return;
+    }
+    if (utf8.error) {
+        b->error = PR_TRUE;
+        PORT_Free(utf8.data);
+        return;
+    }
+
+    from = utf8.data;
+    end = utf8.data + utf8.len;
+    while (from < end && pem_IsSpace(*from))
+        from++;
+    while (end > from && pem_IsSpace(end[-1]))
+        end--;
+
+    /* canonicalize in place, the result is never longer */
+    for (to = utf8.data; from < end; ) {
+        if (*from & 0x80) {
+            *to++ = *from++;
+        } else if (pem_IsSpace(*from)) {
+            *to++ = ' ';
+            while (from < end && pem_IsSpace(*from))
+                from++;
+        } else if (*from >= 'A' && *from <= 'Z') {
+            *to++ = *from++ - 'A' + 'a';
+        } else {
+            *to++ = *from++;
+        }
+    }
+
+    pem_NameBufPutTL(b, 0x0c, to - utf8.data);
+    pem_NameBufPut(b, utf8.data, to - utf8.data);
+    PORT_Free(utf8.data);
+}
+
+typedef struct pemSetElementStr {
+    unsigned int offset;
+    unsigned int len;
+} pemSetElement;
+
+static const unsigned char *pem_setElementBase;
+
+/* DER order of the elements of a SET OF */
+static int
+pem_CompareSetElements(const void *a, const void *b)
+{
+    const pemSetElement *x = a, *y = b;
+    unsigned int n = (x->len < y->len) ? x->len : y->len;
+    int rv = memcmp(pem_setElementBase + x->offset,
+                    pem_setElementBase + y->offset, n);
+
+    if (rv)
+        return rv;
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+/*
+ * Append the canonical encoding of the relative distinguished name in
+ * rdn..end, a SET OF AttributeTypeAndValue.
+ */
+static void
+pem_PutCanonicalRDN(pemNameBuf *b, const unsigned char *rdn,
+                    const unsigned char *end)
+{
+    pemNameBuf set;
+    pemSetElement elements[16];
+    unsigned int nelements = 0;
+    unsigned int i;
+
+    memset(&set, 0, sizeof set);
+    while (rdn < end && !set.error) {
+        const unsigned char *atav, *oid, *atavEnd;
+        unsigned int len, oidLen, valueLen;
+        unsigned char tag, valueTag;
+        pemNameBuf atavBuf;
+
+        if (!pem_GetTagLength(&rdn, end, &tag, &len) || tag != 0x30
+                || nelements == NSS_PEM_ARRAY_SIZE(elements)) {
+            set.error = PR_TRUE;
+            break;
+        }
+        atav = rdn;
+        atavEnd = rdn + len;
+        rdn = atavEnd;
+
+        /* the type as it is, the value in its canonical form */
+        oid = atav;
+        if (!pem_GetTagLength(&atav, atavEnd, &tag, &oidLen) || tag != 0x06) {
+            set.error = PR_TRUE;
+            break;
+        }
+        atav += oidLen;
+        oidLen = atav - oid;
+        if (!pem_GetTagLength(&atav, atavEnd, &valueTag, &valueLen)) {
+            set.error = PR_TRUE;
+            break;
+        }
+
+        memset(&atavBuf, 0, sizeof atavBuf);
+        pem_NameBufPut(&atavBuf, oid, oidLen);
+        pem_PutCanonicalValue(&atavBuf, valueTag, atav, valueLen);
+        if (atavBuf.error) {
+            set.error = PR_TRUE;
+        } else {
+            elements[nelements].offset = set.len;
+            pem_NameBufPutTL(&set, 0x30, atavBuf.len);
+            pem_NameBufPut(&set, atavBuf.data, atavBuf.len);
+            elements[nelements].len = set.len - elements[nelements].offset;
+            nelements++;
+        }
+        PORT_Free(atavBuf.data);
+    }
+
+    if (set.error) {
+        b->error = PR_TRUE;
+        PORT_Free(set.data);
+        return;
+    }
+
+    /* DER sorts the elements of a multi-valued RDN */
+    pem_setElementBase = set.data;
+    qsort(elements, nelements, sizeof elements[0], pem_CompareSetElements);
+
+    pem_NameBufPutTL(b, 0x31, set.len);
+    for (i = 0; i < nelements; i++)
+        pem_NameBufPut(b, set.data + elements[i].offset, elements[i].len);
+    PORT_Free(set.data);
+}
+
+/*
+ * Compute the hash OpenSSL names CApath files after (X509_NAME_hash()) of
+ * the DER encoded name: the first four bytes, little endian, of the SHA-1
+ * hash of the canonical encoding of the RDNs.
+ */
+static SECStatus
+pem_NameHash(const unsigned char *name, unsigned int len, PRUint32 *hash)
+{
+    const unsigned char *p = name, *end = name + len;
+    unsigned char sha1[SHA1_LENGTH];
+    unsigned char tag;
+    unsigned int n;
+    pemNameBuf b;
+    SECStatus rv;
+
+    if (!pem_GetTagLength(&p, end, &tag, &n) || tag != 0x30)
+        return SECFailure;
+    end = p + n;
+
+    memset(&b, 0, sizeof b);
+    while (p < end && !b.error) {
+        if (!pem_GetTagLength(&p, end, &tag, &n) || tag != 0x31) {
+            b.error = PR_TRUE;
+            break;
+        }
+        pem_PutCanonicalRDN(&b, p, p + n);
+        p += n;
+    }
+
+    rv = SECFailure;
+    if (!b.error && SECSuccess == SHA1_HashBuf(sha1, b.data, b.len)) {
+        *hash = sha1[0] | (sha1[1] << 8) | (sha1[2] << 16)
+            | ((PRUint32) sha1[3] << 24);
+        rv = SECSuccess;
+    }
+    PORT_Free(b.data);
+    return rv;
+}
+
+/* the hash of a file name HHHHHHHH.N, or PR_FALSE for other files */
+static PRBool
+pem_ParseHashName(const char *name, PRUint32 *hash)
+{
+    const char *p;
+    char *end;
+
+    for (p = name; p < name + 8; p++) {
+        if (!isxdigit((unsigned char) *p))
+            return PR_FALSE;
+    }
+    if (*p++ != '.' || !isdigit((unsigned char) *p))
+        return PR_FALSE;
+    strtoul(p, &end, 10);
+    if (*end)
+        /* HHHHHHHH.rN are CRLs */
+        return PR_FALSE;
+
+    *hash = strtoul(name, NULL, 16);
+    return PR_TRUE;
+}
+
+static int
+pem_CompareHashes(const void *a, const void *b)
+{
+    PRUint32 x = *(const PRUint32 *) a, y = *(const PRUint32 *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void
+pem_FreeCapath(pemCapath *ca)
+{
+    PORT_Free(ca->hashes);
+    NSS_ZFreeIf(ca->loaded);
+    NSS_ZFreeIf(ca->dir);
+    NSS_ZFreeIf(ca);
+}
+
+/*
+ * Index the hashed directory dir for the slot.  The certificates are only
+ * read as they are looked for, see pem_CapathLoad().
+ */
+CK_RV
+pem_CapathAdd(const char *dir, CK_SLOT_ID slotID)
+{
+    PRDir *d;
+    PRDirEntry *entry;
+    pemCapath *ca;
+    int size = 0;
+    int i, n;
+
+    ca = NSS_ZNEW(NULL, pemCapath);
+    if (!ca)
+        return CKR_HOST_MEMORY;
+    ca->slotID = slotID;
+    ca->dir = NSS_ZAlloc(NULL, strlen(dir) + 1);
+    if (!ca->dir) {
+        pem_FreeCapath(ca);
+        return CKR_HOST_MEMORY;
+    }
+    strcpy(ca->dir, dir);
+
+    d = PR_OpenDir(dir);
+    if (!d) {
+        plog("pem_CapathAdd: cannot open %s\n", dir);
+        pem_FreeCapath(ca);
+        return CKR_GENERAL_ERROR;
+    }
+    while ((entry = PR_ReadDir(d, PR_SKIP_BOTH | PR_SKIP_HIDDEN))) {
+        PRUint32 hash;
+
+        if (!pem_ParseHashName(entry->name, &hash))
+            continue;
+        if (ca->nhashes == size) {
+            PRUint32 *hashes;
+
+            size = size ? 2 * size : 256;
+            hashes = PORT_Realloc(ca->hashes, size * sizeof *hashes);
+            if (!hashes) {
+                PR_CloseDir(d);
+                pem_FreeCapath(ca);
+                return CKR_HOST_MEMORY;
+            }
+            ca->hashes = hashes;
+        }
+        ca->hashes[ca->nhashes++] = hash;
+    }
+    PR_CloseDir(d);
+
+    /* HHHHHHHH.0, HHHHHHHH.1, ... are loaded together */
+    if (ca->nhashes)
+        qsort(ca->hashes, ca->nhashes, sizeof *ca->hashes, pem_CompareHashes);
+    for (i = n = 0; i < ca->nhashes; i++) {
+        if (!n || ca->hashes[n - 1] != ca->hashes[i])
+            ca->hashes[n++] = ca->hashes[i];
+    }
+    ca->nhashes = n;
+
+    ca->loaded = NSS_ZAlloc(NULL, n + 1);
+    if (!ca->loaded) {
+        pem_FreeCapath(ca);
+        return CKR_HOST_MEMORY;
+    }
+
+    plog("pem_CapathAdd: %d subjects in %s\n", n, dir);
+    ca->next = pem_capaths;
+    pem_capaths = ca;
+    return CKR_OK;
+}
+
+/* read the certificates of the given subject hash from ca, once */
+static void
+pem_CapathLoadHash(pemCapath *ca, PRUint32 hash)
+{
+    const PRUint32 *found;
+    char path[4096];
+    struct stat st;
+    int i;
+
+    found = bsearch(&hash, ca->hashes, ca->nhashes, sizeof *ca->hashes,
+                    pem_CompareHashes);
+    if (!found || ca->loaded[found - ca->hashes])
+        return;
+    ca->loaded[found - ca->hashes] = PR_TRUE;
+
+    for (i = 0; ; i++) {
+        snprintf(path, sizeof path, "%s/%08x.%d", ca->dir, hash, i);
+        if (stat(path, &st))
+            break;
+        if (CKR_OK != AddCertificate(path, NULL, PR_TRUE, ca->slotID))
+            plog("pem_CapathLoadHash: cannot load %s\n", path);
+    }
+}
+
+/*
+ * Load the certificates of the hashed directories of the slot which a
+ * search with the given template may find.
+ */
+void
+pem_CapathLoad(CK_SLOT_ID slotID, const CK_ATTRIBUTE *pTemplate,
+               CK_ULONG ulAttributeCount)
+{
+    pemCapath *ca;
+    CK_ULONG i;
+
+    if (!pem_capaths)
+        return;
+
+    for (i = 0; i < ulAttributeCount; i++) {
+        PRUint32 hash;
+
+        if (CKA_SUBJECT != pTemplate[i].type
+                && CKA_ISSUER != pTemplate[i].type)
+            continue;
+        if (SECSuccess != pem_NameHash(pTemplate[i].pValue,
+                                       pTemplate[i].ulValueLen, &hash))
+            continue;
+
+        for (ca = pem_capaths; ca; ca = ca->next) {
+            if (ca->slotID == slotID)
+                pem_CapathLoadHash(ca, hash);
+        }
+    }
+}
+
+/* forget all hashed directories */
+void
+pem_CapathReset(void)
+{
+    while (pem_capaths) {
+        pemCapath *ca = pem_capaths;
+
+        pem_capaths = ca->next;
+        pem_FreeCapath(ca);
+    }
+}
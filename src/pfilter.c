@@ -0,0 +1,331 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Netscape security libraries.
+ *
+ * The Initial Developer of the Original Code is
+ * Netscape Communications Corporation.
+ * Portions created by the Initial Developer are Copyright (C) 1994-2000
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Rob Crittenden (rcritten@redhat.com)
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include "ckpem.h"
+
+#include <nspr.h>
+
+/*
+ * pfilter.c
+ *
+ * Per-slot counting Bloom filters of the "PEM objects" cryptoki module.
+ *
+ * NSS looks for certificates by issuer and serial number, by subject, by
+ * CKA_ID and by DER encoding in every token, even though the PEM token
+ * rarely has them.  The filter of a slot holds these keys of all objects in
+ * the slot, so that pem_FindObjectsInit can tell that a search has no
+ * results without walking the objects of the slot.
+ *
+ * The filter of a slot is built on the first search in the slot (which
+ * needs the certificate fields, see pem_ParseCertFields) and then kept up to
+ * date as objects are added and destroyed.  A filter that gets too full is
+ * dropped and built again on the next search.
+ */
+
+#define PEM_FILTER_HASHES       4
+#define PEM_FILTER_MIN_SIZE     4096    /* counters */
+#define PEM_FILTER_LOAD         16      /* counters per key */
+
+/* tags of the keys, so that equal values of different attributes differ */
+#define PEM_KEY_ID              'I'
+#define PEM_KEY_SUBJECT         'S'
+#define PEM_KEY_ISSUER_SERIAL   'N'
+#define PEM_KEY_DER             'D'
+
+typedef struct pemSlotFilterStr {
+    PRUint8     *counters;      /* NULL if not built */
+    PRUint32    mask;           /* number of counters - 1 */
+    PRUint32    nkeys;
+} pemSlotFilter;
+
+static pemSlotFilter pem_filters[NUM_SLOTS + 1];
+
+static pemSlotFilter *
+pem_GetFilter(CK_SLOT_ID slotID)
+{
+    return (slotID <= NUM_SLOTS) ? &pem_filters[slotID] : NULL;
+}
+
+/* 64-bit FNV-1a */
+static PRUint64
+pem_FilterHashUpdate(PRUint64 h, const void *data, PRUint32 len)
+{
+    const unsigned char *p = data;
+    PRUint32 i;
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static PRUint64
+pem_FilterHash(unsigned char tag, const void *a, PRUint32 alen,
+               const void *b, PRUint32 blen)
+{
+    PRUint64 h = 0xcbf29ce484222325ULL;
+
+    h = pem_FilterHashUpdate(h, &tag, 1);
+    h = pem_FilterHashUpdate(h, &alen, sizeof alen);
+    h = pem_FilterHashUpdate(h, a, alen);
+    return pem_FilterHashUpdate(h, b, blen);
+}
+
+/* add (delta = 1) or remove (delta = -1) a key */
+static void
+pem_FilterUpdate(pemSlotFilter *f, PRUint64 h, int delta)
+{
+    PRUint32 h1 = (PRUint32) h;
+    PRUint32 h2 = (PRUint32) (h >> 32) | 1;
+    int i;
+
+    for (i = 0; i < PEM_FILTER_HASHES; i++) {
+        PRUint8 *c = &f->counters[(h1 + i * h2) & f->mask];
+
+        /* a saturated counter can no longer be decremented safely */
+        if (*c != 0xff && (0 < delta || 0 < *c))
+            *c += delta;
+    }
+
+    if (0 < delta)
+        f->nkeys++;
+    else
+        f->nkeys--;
+}
+
+static PRBool
+pem_FilterContains(const pemSlotFilter *f, PRUint64 h)
+{
+    PRUint32 h1 = (PRUint32) h;
+    PRUint32 h2 = (PRUint32) (h >> 32) | 1;
+    int i;
+
+    for (i = 0; i < PEM_FILTER_HASHES; i++) {
+        if (0 == f->counters[(h1 + i * h2) & f->mask])
+            return PR_FALSE;
+    }
+    return PR_TRUE;
+}
+
+static void
+pem_FilterDrop(pemSlotFilter *f)
+{
+    NSS_ZFreeIf(f->counters);
+    memset(f, 0, sizeof *f);
+}
+
+/* add or remove the keys of the given object */
+static void
+pem_FilterObject(pemSlotFilter *f, pemInternalObject *io, int delta)
+{
+    if (io->id.size)
+        pem_FilterUpdate(f, pem_FilterHash(PEM_KEY_ID, io->id.data,
+                                           io->id.size, NULL, 0), delta);
+
+    if (CKO_CERTIFICATE != io->objClass && CKO_NSS_TRUST != io->objClass)
+        return;
+
+    if (CKO_CERTIFICATE == io->objClass)
+        pem_FilterUpdate(f, pem_FilterHash(PEM_KEY_DER, io->derCert->data,
+                                           io->derCert->len, NULL, 0), delta);
+
+    if (SECSuccess != pem_ParseCertFields(io))
+        /* the object can match neither by subject nor by issuer */
+        return;
+
+    pem_FilterUpdate(f, pem_FilterHash(PEM_KEY_ISSUER_SERIAL,
+                                       io->u.cert.issuer.data,
+                                       io->u.cert.issuer.size,
+                                       io->u.cert.serial.data,
+                                       io->u.cert.serial.size), delta);
+    if (CKO_CERTIFICATE == io->objClass)
+        pem_FilterUpdate(f, pem_FilterHash(PEM_KEY_SUBJECT,
+                                           io->u.cert.subject.data,
+                                           io->u.cert.subject.size,
+                                           NULL, 0), delta);
+}
+
+static PRBool
+pem_FilterIsIndexed(const pemInternalObject *io)
+{
+    return (pemCert == io->type || pemBareKey == io->type
+            || pemTrust == io->type);
+}
+
+static PRBool
+pem_FilterBuild(pemSlotFilter *f, CK_SLOT_ID slotID)
+{
+    pemSlotStore *store = pem_GetSlotStore(slotID, PR_FALSE);
+    pemInternalObject *obj;
+    long i;
+    PRUint32 size = PEM_FILTER_MIN_SIZE;
+    PRUint32 nobjs = store ? store->nobjs : 0;
+
+    /* up to 4 keys per object */
+    while (size < 4 * PEM_FILTER_LOAD * nobjs && size < 0x40000000)
+        size <<= 1;
+
+    f->counters = NSS_ZAlloc(NULL, size);
+    if (!f->counters)
+        return PR_FALSE;
+    f->mask = size - 1;
+    f->nkeys = 0;
+
+    if (!store)
+        return PR_TRUE;
+
+    for (i = 0; i < store->nentries; i++) {
+        obj = store->objs[i].io;
+        if (obj && pem_FilterIsIndexed(obj))
+            pem_FilterObject(f, obj, 1);
+    }
+    return PR_TRUE;
+}
+
+void
+pem_FilterAdd(pemInternalObject *io)
+{
+    pemSlotFilter *f = pem_GetFilter(io->slotID);
+
+    if (!f || !f->counters || !pem_FilterIsIndexed(io))
+        return;
+
+    pem_FilterObject(f, io, 1);
+    if (f->nkeys * PEM_FILTER_LOAD > f->mask + 1)
+        /* too many false positives, build a bigger one when needed */
+        pem_FilterDrop(f);
+}
+
+void
+pem_FilterRemove(pemInternalObject *io)
+{
+    pemSlotFilter *f = pem_GetFilter(io->slotID);
+
+    if (!f || !f->counters || !pem_FilterIsIndexed(io))
+        return;
+
+    pem_FilterObject(f, io, -1);
+}
+
+static const CK_ATTRIBUTE *
+pem_FindTemplateAttribute(CK_ATTRIBUTE_TYPE type, const CK_ATTRIBUTE *pTemplate,
+                          CK_ULONG ulAttributeCount)
+{
+    CK_ULONG i;
+
+    for (i = 0; i < ulAttributeCount; i++) {
+        if (type == pTemplate[i].type)
+            return &pTemplate[i];
+    }
+    return NULL;
+}
+
+/*
+ * Return PR_FALSE if no object of class objClass (CK_INVALID_HANDLE for any)
+ * in the slot can match the template, PR_TRUE if some might.
+ */
+PRBool
+pem_FilterMayMatch(CK_SLOT_ID slotID, CK_OBJECT_CLASS objClass,
+                   const CK_ATTRIBUTE *pTemplate, CK_ULONG ulAttributeCount)
+{
+    pemSlotFilter *f = pem_GetFilter(slotID);
+    const CK_ATTRIBUTE *a, *b;
+    PRBool isCert = (CKO_CERTIFICATE == objClass);
+
+    if (!f)
+        return PR_TRUE;
+
+    switch (objClass) {
+    case CK_INVALID_HANDLE:
+    case CKO_CERTIFICATE:
+    case CKO_PRIVATE_KEY:
+    case CKO_NSS_TRUST:
+        break;
+    default:
+        /* no keys of other objects are kept */
+        return PR_TRUE;
+    }
+
+    if (!f->counters && !pem_FilterBuild(f, slotID))
+        return PR_TRUE;
+
+    a = pem_FindTemplateAttribute(CKA_ID, pTemplate, ulAttributeCount);
+    if (a && !pem_FilterContains(f, pem_FilterHash(PEM_KEY_ID, a->pValue,
+                                                   a->ulValueLen, NULL, 0)))
+        return PR_FALSE;
+
+    if (isCert) {
+        a = pem_FindTemplateAttribute(CKA_SUBJECT, pTemplate,
+                                      ulAttributeCount);
+        if (a && !pem_FilterContains(f, pem_FilterHash(PEM_KEY_SUBJECT,
+                                                       a->pValue,
+                                                       a->ulValueLen,
+                                                       NULL, 0)))
+            return PR_FALSE;
+
+        a = pem_FindTemplateAttribute(CKA_VALUE, pTemplate, ulAttributeCount);
+        if (a && !pem_FilterContains(f, pem_FilterHash(PEM_KEY_DER,
+                                                       a->pValue,
+                                                       a->ulValueLen,
+                                                       NULL, 0)))
+            return PR_FALSE;
+    }
+
+    if (isCert || CKO_NSS_TRUST == objClass) {
+        a = pem_FindTemplateAttribute(CKA_ISSUER, pTemplate, ulAttributeCount);
+        b = pem_FindTemplateAttribute(CKA_SERIAL_NUMBER, pTemplate,
+                                      ulAttributeCount);
+        if (a && b
+            && !pem_FilterContains(f, pem_FilterHash(PEM_KEY_ISSUER_SERIAL,
+                                                     a->pValue, a->ulValueLen,
+                                                     b->pValue,
+                                                     b->ulValueLen)))
+            return PR_FALSE;
+    }
+
+    return PR_TRUE;
+}
+
+void
+pem_FilterReset(void)
+{
+    int i;
+
+    for (i = 0; i <= NUM_SLOTS; i++)
+        pem_FilterDrop(&pem_filters[i]);
+}
@@ -44,13 +44,262 @@
  * "PEM objects" cryptoki module.
  */
 
+/*
+ * The template is compiled into a match program in FindObjectsInit.  Each
+ * step tests one attribute.  The steps are ordered by their cost: the object
+ * class is compared directly with objClass, attributes whose location is
+ * known for the class being searched for are compared without going through
+ * pem_FetchAttribute, and only the rest takes the generic path.  Values are
+ * compared by length first, then by their first 8 bytes, which are loaded
+ * once when the template is compiled.
+ */
+typedef enum {
+    pemMatchClass,              /* objClass */
+    pemMatchId,                 /* id */
+    pemMatchCertField,          /* NSSItem at offset after pem_ParseCertFields */
+    pemMatchDER,                /* derCert */
+    pemMatchGeneric,            /* pem_FetchAttribute */
+    pemMatchKinds
+} pemMatchKind;
+
+typedef struct pemMatchOpStr {
+    pemMatchKind kind;
+    size_t offset;
+    CK_ATTRIBUTE_PTR attr;
+    PRUint32 idHash;            /* pem_HashId() of the value for pemMatchId */
+} pemMatchOp;
+
+/*
+ * The objects are not collected in FindObjectsInit.  Instead the find state
+ * is a cursor into the objects of the slot which pem_mdFindObjects_Next
+ * advances to the next match.  Objects are appended to the slot store in the
+ * order of arrayIdx, so objects created after FindObjectsInit are recognized
+ * by arrayIdx and skipped.  The cursor is an index into the array of the
+ * store, it is looked up again by the arrayIdx of the last object visited if
+ * the array has been compacted in the meantime.
+ */
 struct pemFOStr {
-    NSSArena *arena;
-    CK_ULONG n;
-    CK_ULONG i;
-    pemInternalObject **objs;
+    NSSCKMDFindObjects mdFindObjects;
+    struct pemFOStr *next;              /* in the free list of the session */
+    CK_ATTRIBUTE_PTR pTemplate;         /* copy of the caller's template */
+    CK_ULONG ulAttributeCount;
+    pemMatchOp *program;                /* ulAttributeCount steps */
+    CK_ULONG capacity;                  /* of pTemplate and program */
+    unsigned char *values;              /* values of pTemplate */
+    PRUint32 valuesCapacity;
+    pemObjectType type;
+    CK_SLOT_ID slotID;
+    pemSlotStore *store;                /* NULL if the slot has no objects */
+    long limit;                         /* pem_nobjs at FindObjectsInit */
+    long i;                             /* next entry of store->objs */
+    long lastIdx;                       /* arrayIdx of the last entry seen */
+    PRUint32 generation;                /* of store when i was valid */
+    pemInternalObject *stats;           /* statistics object to return */
+    CK_ULONG found;
+    PRBool done;
 };
 
+/*
+ * The length decides most mismatches.  DER values of equal length mostly
+ * share their leading tags and lengths, so comparing a prefix first would
+ * not save memcmp() from looking at the rest.  CKA_ID is already filtered
+ * by its hash in pem_hotmatch().
+ */
+static CK_BBOOL
+pem_matchvalue(const pemMatchOp *op, const void *data, PRUint32 size)
+{
+    return (op->attr->ulValueLen == size)
+        && (0 == memcmp(op->attr->pValue, data, size));
+}
+
+static CK_BBOOL
+pem_attrmatch(const pemMatchOp *op, pemInternalObject * o) {
+    const NSSItem *b;
+    CK_RV error = CKR_OK;
+
+    b = pem_FetchAttribute(o, op->attr->type, &error);
+    return (b != NULL) && pem_matchvalue(op, b->data, b->size);
+}
+
+static CK_BBOOL
+pem_opmatch(const pemMatchOp *op, pemInternalObject * o)
+{
+    const NSSItem *item;
+
+    if (pemRaw == o->type)
+        /* only the generic path knows the attributes of raw objects */
+        return pem_attrmatch(op, o);
+
+    switch (op->kind) {
+    case pemMatchClass:
+        return (o->objClass == *(CK_OBJECT_CLASS *) op->attr->pValue);
+    case pemMatchId:
+        return pem_matchvalue(op, o->id.data, o->id.size);
+    case pemMatchCertField:
+        if (SECSuccess != pem_ParseCertFields(o))
+            return CK_FALSE;
+        item = (const NSSItem *) ((const char *) o + op->offset);
+        return pem_matchvalue(op, item->data, item->size);
+    case pemMatchDER:
+        return (NULL != o->derCert)
+            && pem_matchvalue(op, o->derCert->data, o->derCert->len);
+    default:
+        return pem_attrmatch(op, o);
+    }
+}
+
+static CK_BBOOL
+pem_match
+(
+    const struct pemFOStr *fo,
+    pemInternalObject * o
+)
+{
+    CK_ULONG i;
+
+    for (i = 0; i < fo->ulAttributeCount; i++) {
+        const pemMatchOp *op = &fo->program[i];
+        CK_BBOOL match = pem_opmatch(op, o);
+
+        pem_Trace(PEM_TRACE_MATCH, pemTraceFindMatch, o->arrayIdx,
+                  ((PRUint64) op->attr->type << 1) | match);
+        if (CK_FALSE == match) {
+            return CK_FALSE;
+        }
+    }
+
+    /* Every attribute passed */
+    return CK_TRUE;
+}
+
+/*
+ * Run the steps of the program that can be decided by the summary of the
+ * object in the slot store, without touching the object itself.  A CKA_ID
+ * with an equal hash still needs to be compared by pem_match().
+ */
+static CK_BBOOL
+pem_hotmatch(const struct pemFOStr *fo, const pemHotObject *hot)
+{
+    CK_ULONG i;
+
+    for (i = 0; i < fo->ulAttributeCount; i++) {
+        const pemMatchOp *op = &fo->program[i];
+
+        switch (op->kind) {
+        case pemMatchClass:
+            if (hot->objClass != *(CK_OBJECT_CLASS *) op->attr->pValue)
+                return CK_FALSE;
+            break;
+        case pemMatchId:
+            if (hot->idHash != op->idHash)
+                return CK_FALSE;
+            break;
+        default:
+            /* the cheap steps come first */
+            return CK_TRUE;
+        }
+    }
+
+    return CK_TRUE;
+}
+
+/* choose how to test the given attribute of objects of class objClass */
+static void
+pem_CompileMatchOp(pemMatchOp *op, CK_ATTRIBUTE_PTR attr,
+                   CK_OBJECT_CLASS objClass)
+{
+    op->attr = attr;
+    op->kind = pemMatchGeneric;
+
+    switch (attr->type) {
+    case CKA_CLASS:
+        if (sizeof(CK_OBJECT_CLASS) == attr->ulValueLen)
+            op->kind = pemMatchClass;
+        break;
+    case CKA_ID:
+        if (CKO_CERTIFICATE == objClass || CKO_PRIVATE_KEY == objClass
+            || CKO_NSS_TRUST == objClass) {
+            NSSItem value;
+
+            value.data = attr->pValue;
+            value.size = attr->ulValueLen;
+            op->kind = pemMatchId;
+            op->idHash = pem_HashId(&value);
+        }
+        break;
+    case CKA_SUBJECT:
+        if (CKO_CERTIFICATE == objClass) {
+            op->kind = pemMatchCertField;
+            op->offset = offsetof(pemInternalObject, u.cert.subject);
+        }
+        break;
+    case CKA_ISSUER:
+        if (CKO_CERTIFICATE == objClass || CKO_NSS_TRUST == objClass) {
+            op->kind = pemMatchCertField;
+            op->offset = offsetof(pemInternalObject, u.cert.issuer);
+        }
+        break;
+    case CKA_SERIAL_NUMBER:
+        if (CKO_CERTIFICATE == objClass || CKO_NSS_TRUST == objClass) {
+            op->kind = pemMatchCertField;
+            op->offset = offsetof(pemInternalObject, u.cert.serial);
+        }
+        break;
+    case CKA_VALUE:
+        if (CKO_CERTIFICATE == objClass)
+            op->kind = pemMatchDER;
+        break;
+    }
+}
+
+/* compile fo->pTemplate into fo->program, cheapest steps first */
+static void
+pem_CompileMatch(struct pemFOStr *fo, CK_OBJECT_CLASS objClass)
+{
+    pemMatchOp op;
+    CK_ULONG i, n = 0;
+    int kind;
+
+    for (kind = 0; kind < pemMatchKinds; kind++) {
+        for (i = 0; i < fo->ulAttributeCount; i++) {
+            memset(&op, 0, sizeof op);
+            pem_CompileMatchOp(&op, &fo->pTemplate[i], objClass);
+            if (kind == op.kind)
+                fo->program[n++] = op;
+        }
+    }
+}
+
+CK_OBJECT_CLASS
+pem_GetObjectClass(CK_ATTRIBUTE_PTR pTemplate,
+                   CK_ULONG ulAttributeCount)
+{
+    CK_ULONG i;
+
+    for (i = 0; i < ulAttributeCount; i++) {
+        if (pTemplate[i].type == CKA_CLASS) {
+            return *(CK_OBJECT_CLASS *) pTemplate[i].pValue;
+        }
+    }
+    /* need to return a value that says 'fetch them all' */
+    return CK_INVALID_HANDLE;
+}
+
+static void
+pem_FreeFindObjects(struct pemFOStr *fo)
+{
+    NSS_ZFreeIf(fo->pTemplate);
+    NSS_ZFreeIf(fo->program);
+    NSS_ZFreeIf(fo->values);
+    NSS_ZFreeIf(fo);
+}
+
+/* find states kept for reuse per session, more are freed */
+#define PEM_FIND_FREE_LIST_MAX 4
+
+/* bound of the copy of a template, far beyond any value an object has */
+#define PEM_FIND_VALUES_MAX (1 << 24)
+
 static void
 pem_mdFindObjects_Final
 (
@@ -65,16 +314,75 @@ pem_mdFindObjects_Final
 )
 {
     struct pemFOStr *fo = (struct pemFOStr *) mdFindObjects->etc;
-    NSSArena *arena = fo->arena;
+    pemSession *session = (pemSession *) mdSession->etc;
 
-    NSS_ZFreeIf(fo->objs);
-    NSS_ZFreeIf(fo);
-    NSS_ZFreeIf(mdFindObjects);
-    if ((NSSArena *) NULL != arena) {
-        NSSArena_Destroy(arena);
+    if (session->nfreeFinds < PEM_FIND_FREE_LIST_MAX) {
+        fo->next = session->freeFinds;
+        session->freeFinds = fo;
+        session->nfreeFinds++;
+        return;
+    }
+
+    pem_FreeFindObjects(fo);
+}
+
+/* release the find states kept by a session that is being closed */
+void
+pem_DestroyFindObjectsCache(pemSession *session)
+{
+    while (session->freeFinds) {
+        struct pemFOStr *fo = session->freeFinds;
+
+        session->freeFinds = fo->next;
+        pem_FreeFindObjects(fo);
+    }
+    session->nfreeFinds = 0;
+}
+
+/* make room in fo for a copy of the given template */
+static CK_RV
+pem_FindObjectsReserve(struct pemFOStr *fo, CK_ATTRIBUTE_PTR pTemplate,
+                       CK_ULONG ulAttributeCount)
+{
+    size_t valuesSize = 0;
+    CK_ULONG i;
+
+    if (ulAttributeCount > PEM_FIND_VALUES_MAX / sizeof(CK_ATTRIBUTE))
+        return CKR_ARGUMENTS_BAD;
+
+    /* keep the values aligned, CKA_CLASS is read as CK_OBJECT_CLASS; both
+     * valuesSize and the bound are multiples of 8, so the sum stays within
+     * the bound, which also rejects CK_UNAVAILABLE_INFORMATION */
+    for (i = 0; i < ulAttributeCount; i++) {
+        CK_ULONG len = pTemplate[i].ulValueLen;
+
+        if (len > PEM_FIND_VALUES_MAX - valuesSize
+                || (len && !pTemplate[i].pValue))
+            return CKR_ATTRIBUTE_VALUE_INVALID;
+        valuesSize += (len + 7) & ~(CK_ULONG) 7;
+    }
+
+    if (fo->capacity < ulAttributeCount) {
+        NSS_ZFreeIf(fo->pTemplate);
+        NSS_ZFreeIf(fo->program);
+        fo->capacity = 0;
+        fo->pTemplate = NSS_ZNEWARRAY(NULL, CK_ATTRIBUTE, ulAttributeCount);
+        fo->program = NSS_ZNEWARRAY(NULL, pemMatchOp, ulAttributeCount);
+        if (!fo->pTemplate || !fo->program)
+            return CKR_HOST_MEMORY;
+        fo->capacity = ulAttributeCount;
+    }
+
+    if (fo->valuesCapacity < valuesSize) {
+        NSS_ZFreeIf(fo->values);
+        fo->valuesCapacity = 0;
+        fo->values = NSS_ZAlloc(NULL, (PRUint32) valuesSize);
+        if (!fo->values)
+            return CKR_HOST_MEMORY;
+        fo->valuesCapacity = (PRUint32) valuesSize;
     }
 
-    return;
+    return CKR_OK;
 }
 
 static NSSCKMDObject *
@@ -93,329 +401,216 @@ pem_mdFindObjects_Next
 )
 {
     struct pemFOStr *fo = (struct pemFOStr *) mdFindObjects->etc;
-    pemInternalObject *io;
+    pemInternalObject *io = NULL;
+    pemSlotStore *store = fo->store;
 
     plog("pem_FindObjects_Next: ");
+    *pError = CKR_OK;
+
+    if (fo->stats) {
+        /* not kept in the slot store, there is one per slot */
+        io = fo->stats;
+        fo->stats = NULL;
+        goto found;
+    }
 
-    if (fo->i == fo->n) {
+    if (fo->done) {
         plog("Done creating objects\n");
-        *pError = CKR_OK;
         return (NSSCKMDObject *) NULL;
     }
 
-    io = fo->objs[fo->i];
-    fo->i++;
-
-    plog("Creating object for type %d\n", io->type);
-
-    if (!io->extRef) {
-        /* increase reference count only once as ckfw will free the found
-         * object only once */
-        io->extRef = CK_TRUE;
-        io->refCount ++;
+    if (fo->generation != store->generation) {
+        /* holes have been squeezed out of the array */
+        fo->i = pem_SlotStoreSeek(store, fo->lastIdx);
+        fo->generation = store->generation;
     }
 
-    return pem_CreateMDObject(arena, io, pError);
-}
+    for (; fo->i < store->nentries; fo->i++) {
+        const pemHotObject *hot = &store->objs[fo->i];
 
-static char * pem_attr_name(CK_ATTRIBUTE_TYPE type) {
-    switch(type) {
-    case CKA_CLASS:
-        return "CKA_CLASS";
-    case CKA_TOKEN:
-        return "CKA_TOKEN";
-    case CKA_PRIVATE:
-        return "CKA_PRIVATE";
-    case CKA_LABEL:
-        return "CKA_LABEL";
-    case CKA_APPLICATION:
-        return "CKA_APPLICATION";
-    case CKA_VALUE:
-        return "CKA_VALUE";
-    case CKA_OBJECT_ID:
-        return "CKA_OBJECT_ID";
-    case CKA_CERTIFICATE_TYPE:
-        return "CKA_CERTIFICATE_TYPE";
-    case CKA_ISSUER:
-        return "CKA_ISSUER";
-    case CKA_SERIAL_NUMBER:
-        return "CKA_SERIAL_NUMBER";
-    case CKA_ID:
-        return "CKA_ID";
-    default:
-        return "unknown";
-    }
-}
+        if (fo->limit <= hot->arrayIdx)
+            /* added after FindObjectsInit */
+            break;
 
-static CK_BBOOL
-pem_attrmatch(CK_ATTRIBUTE_PTR a, pemInternalObject * o) {
-    PRBool prb;
-    const NSSItem *b;
-    CK_RV error = CKR_OK;
+        if (NULL == hot->io)
+            continue;
 
-    b = pem_FetchAttribute(o, a->type, &error);
-    if (b == NULL) {
-        plog("pem_attrmatch %s %08x: CK_FALSE attr not found\n", pem_attr_name(a->type), a->type);
-        return CK_FALSE;
+        if ((fo->type != pemAll) && (fo->type != hot->type))
+            continue;
+
+        if (pem_hotmatch(fo, hot) && pem_match(fo, hot->io)) {
+            io = hot->io;
+            fo->lastIdx = hot->arrayIdx;
+            fo->i++;
+            break;
+        }
     }
 
-    if (a->ulValueLen != b->size) {
-         plog("pem_attrmatch %s %08x: CK_FALSE size mismatch %d vs %d\n", pem_attr_name(a->type), a->type, a->ulValueLen, b->size);
-        return CK_FALSE;
+    if (NULL == io) {
+        fo->done = PR_TRUE;
+        plog("pem_FindObjects_Next: Found %ld\n", fo->found);
+        pem_Trace(PEM_TRACE_FIND, pemTraceFindDone, fo->slotID, fo->found);
+        return (NSSCKMDObject *) NULL;
     }
 
-    prb = (0 == memcmp(a->pValue, b->data, b->size));
+  found:
+    fo->found++;
+    plog("Creating object for type %d\n", io->type);
 
-    if (PR_TRUE == prb) {
-        plog("pem_attrmatch %s %08x: CK_TRUE\n", pem_attr_name(a->type), a->type);
-        return CK_TRUE;
-    } else {
-        plog("pem_attrmatch %s %08x: CK_FALSE\n", pem_attr_name(a->type), a->type);
-        plog("type: %d, a->pValue %08x, b->data %08x", o->objClass, a->pValue, b->data);
-        if (o->objClass == CKO_CERTIFICATE) {
-            plog(", label: %s\n", o->u.cert.label.data);
-        }
-        plog("\n");
-        return CK_FALSE;
+    if (!io->extRef) {
+        /* increase reference count only once as ckfw will free the found
+         * object only once */
+        io->extRef = CK_TRUE;
+        io->refCount ++;
     }
+
+    return pem_CreateMDObject(arena, io, pError);
 }
 
-static CK_BBOOL
-pem_match
+NSS_IMPLEMENT NSSCKMDFindObjects *
+pem_FindObjectsInit
 (
+    NSSCKMDSession * mdSession,
+    NSSCKFWSession * fwSession,
     CK_ATTRIBUTE_PTR pTemplate,
     CK_ULONG ulAttributeCount,
-    pemInternalObject * o
+    CK_RV * pError
 )
 {
+    pemSession *session = (pemSession *) mdSession->etc;
+    struct pemFOStr *fo = (struct pemFOStr *) NULL;
+    unsigned char *value;
+    NSSCKFWSlot *fwSlot;
+    CK_SLOT_ID slotID;
+    CK_OBJECT_CLASS objClass;
     CK_ULONG i;
+    PRIntervalTime start = PR_IntervalNow();
 
-    for (i = 0; i < ulAttributeCount; i++) {
-        if (CK_FALSE == pem_attrmatch(&pTemplate[i], o)) {
-            plog("pem_match: CK_FALSE\n");
-            return CK_FALSE;
-        }
-    }
-
-    /* Every attribute passed */
-    plog("pem_match: CK_TRUE\n");
-    return CK_TRUE;
-}
-
-CK_OBJECT_CLASS
-pem_GetObjectClass(CK_ATTRIBUTE_PTR pTemplate,
-                   CK_ULONG ulAttributeCount)
-{
-    CK_ULONG i;
-
-    for (i = 0; i < ulAttributeCount; i++) {
-        if (pTemplate[i].type == CKA_CLASS) {
-            return *(CK_OBJECT_CLASS *) pTemplate[i].pValue;
-        }
+    plog("pem_FindObjectsInit\n");
+    fwSlot = NSSCKFWSession_GetFWSlot(fwSession);
+    if ((NSSCKFWSlot *) NULL == fwSlot) {
+        goto loser;
     }
-    /* need to return a value that says 'fetch them all' */
-    return CK_INVALID_HANDLE;
-}
+    slotID = NSSCKFWSlot_GetSlotID(fwSlot);
 
-static void *
-ensure_array_capacity(void *array,
-                      size_t *current_items_capacity,
-                      const size_t required_items_capacity,
-                      const size_t sizeof_one_item,
-                      const size_t resize_add_number_of_items)
-{
-    if (required_items_capacity <= *current_items_capacity) {
-        return array;
+    /* reuse the state of a finished search if there is one */
+    fo = session->freeFinds;
+    if (fo) {
+        session->freeFinds = fo->next;
+        session->nfreeFinds--;
     } else {
-        void *new_array;
-        size_t new_size_in_bytes =
-            sizeof_one_item * ((*current_items_capacity)+resize_add_number_of_items);
-        if (array) {
-            PORT_Assert(*current_items_capacity > 0);
-            new_array = NSS_ZRealloc(array, new_size_in_bytes);
-        } else {
-            PORT_Assert(*current_items_capacity == 0);
-            new_array = NSS_ZAlloc(NULL, new_size_in_bytes);
+        fo = NSS_ZNEW(NULL, struct pemFOStr);
+        if ((struct pemFOStr *) NULL == fo) {
+            *pError = CKR_HOST_MEMORY;
+            goto loser;
         }
-        (*current_items_capacity) += resize_add_number_of_items;
-        return new_array;
     }
-}
 
-static PRUint32
-collect_objects(CK_ATTRIBUTE_PTR pTemplate,
-                CK_ULONG ulAttributeCount,
-                pemInternalObject *** result_array,
-                CK_RV * pError, CK_SLOT_ID slotID)
-{
-    size_t result_array_entries = 0;
-    size_t result_array_capacity = 0;
-    pemObjectType type = pemRaw;
-    CK_OBJECT_CLASS objClass = pem_GetObjectClass(pTemplate, ulAttributeCount);
-    pemInternalObject *obj = NULL;
+    *pError = pem_FindObjectsReserve(fo, pTemplate, ulAttributeCount);
+    if (CKR_OK != *pError) {
+        goto loser;
+    }
 
-    *pError = CKR_OK;
+    fo->next = NULL;
+    fo->type = pemRaw;
+    fo->slotID = slotID;
+
+    /* certificates of hashed directories are loaded as they are looked for */
+    objClass = pem_GetObjectClass(pTemplate, ulAttributeCount);
+    if (CK_INVALID_HANDLE == objClass || CKO_CERTIFICATE == objClass
+            || CKO_NSS_TRUST == objClass)
+        pem_CapathLoad(slotID, pTemplate, ulAttributeCount);
+
+    fo->store = pem_GetSlotStore(slotID, PR_FALSE);
+    fo->generation = fo->store ? fo->store->generation : 0;
+    fo->limit = pem_nobjs;
+    fo->i = 0;
+    fo->lastIdx = -1;
+    fo->stats = NULL;
+    fo->found = 0;
+    fo->done = PR_FALSE;
+
+    memset(&fo->mdFindObjects, 0, sizeof fo->mdFindObjects);
+    fo->mdFindObjects.etc = (void *) fo;
+    fo->mdFindObjects.Final = pem_mdFindObjects_Final;
+    fo->mdFindObjects.Next = pem_mdFindObjects_Next;
+
+    /* the template belongs to the caller of C_FindObjectsInit */
+    value = fo->values;
+    for (i = 0; i < ulAttributeCount; i++) {
+        fo->pTemplate[i].type = pTemplate[i].type;
+        fo->pTemplate[i].ulValueLen = pTemplate[i].ulValueLen;
+        fo->pTemplate[i].pValue = value;
+        if (0 == pTemplate[i].ulValueLen)
+            continue;
+        memcpy(value, pTemplate[i].pValue, pTemplate[i].ulValueLen);
+        value += (pTemplate[i].ulValueLen + 7) & ~7;
+    }
+    fo->ulAttributeCount = ulAttributeCount;
 
-    plog("collect_objects slot #%ld, ", slotID);
+    pem_Trace(PEM_TRACE_FIND, pemTraceFindInit, slotID, ulAttributeCount);
+    plog("pem_FindObjectsInit slot #%ld, ", slotID);
     plog("%d attributes, ", ulAttributeCount);
     plog("%ld objects created in total.\n", pem_nobjs);
     plog("Looking for: ");
+
+    pem_CompileMatch(fo, objClass);
+
     /*
      * now determine type of the object
      */
     switch (objClass) {
     case CKO_CERTIFICATE:
         plog("CKO_CERTIFICATE\n");
-        type = pemCert;
+        fo->type = pemCert;
         break;
     case CKO_PUBLIC_KEY:
         plog("CKO_PUBLIC_KEY\n");
-        type = pemBareKey;
+        fo->type = pemBareKey;
         break;
     case CKO_PRIVATE_KEY:
-        type = pemBareKey;
+        fo->type = pemBareKey;
         plog("CKO_PRIVATE_KEY\n");
         break;
     case CKO_NSS_TRUST:
-        type = pemTrust;
+        fo->type = pemTrust;
         plog("CKO_NSS_TRUST\n");
         break;
-    case CKO_NSS_CRL:
-        plog("CKO_NSS_CRL\n");
-        goto done;
-    case CKO_NSS_SMIME:
-        plog("CKO_NSS_SMIME\n");
-        goto done;
-    case CKO_NSS_BUILTIN_ROOT_LIST:
-        plog("CKO_NSS_BUILTIN_ROOT_LIST\n");
-        goto done;
+    case CKO_PEM_STATS:
+        plog("CKO_PEM_STATS\n");
+        fo->stats = pem_GetStatsObject(slotID);
+        if (fo->stats && !pem_match(fo, fo->stats))
+            fo->stats = NULL;
+        fo->done = PR_TRUE;
+        break;
     case CK_INVALID_HANDLE:
-        type = pemAll; /* look through all objectclasses - ignore the type field */
+        fo->type = pemAll; /* look through all objectclasses - ignore the type field */
         plog("CK_INVALID_HANDLE\n");
         break;
     default:
+        /* CKO_NSS_CRL, CKO_NSS_SMIME, CKO_NSS_BUILTIN_ROOT_LIST, ... */
         plog("no other object types %08x\n", objClass);
-        goto done; /* no other object types we understand in this module */
-    }
-
-    /* find objects */
-    list_for_each_entry(obj, &pem_objs, gl_list) {
-        int match = 1; /* matches type if type not specified */
-        plog("  %ld type = %d\n", obj->arrayIdx, obj->type);
-        if (type != pemAll) {
-            /* type specified - must match given type */
-            match = (type == obj->type);
-        }
-        if (match) {
-            match = (slotID == obj->slotID) &&
-                (CK_TRUE == pem_match(pTemplate, ulAttributeCount, obj));
-        }
-        if (match) {
-            pemInternalObject **new_result_array = (pemInternalObject **)
-                ensure_array_capacity(*result_array,
-                                      &result_array_capacity,
-                                      result_array_entries+1,
-                                      sizeof(pemInternalObject *),
-                                      512 /*add number of items per resize*/);
-            if (!new_result_array) {
-                *pError = CKR_HOST_MEMORY;
-                goto loser;
-            }
-            if (*result_array != new_result_array) {
-                *result_array = new_result_array;
-            }
-            (*result_array)[ result_array_entries ] = obj;
-            result_array_entries++;
-        }
-    }
-
-    if (CKR_OK != *pError) {
-        goto loser;
-    }
-
-  done:
-    plog("collect_objects: Found %d\n", result_array_entries);
-    return result_array_entries;
-  loser:
-    NSS_ZFreeIf(*result_array);
-    return 0;
-
-}
-
-NSS_IMPLEMENT NSSCKMDFindObjects *
-pem_FindObjectsInit
-(
-    NSSCKFWSession * fwSession,
-    CK_ATTRIBUTE_PTR pTemplate,
-    CK_ULONG ulAttributeCount,
-    CK_RV * pError
-)
-{
-    NSSArena *arena = NULL;
-    NSSCKMDFindObjects *rv = (NSSCKMDFindObjects *) NULL;
-    struct pemFOStr *fo = (struct pemFOStr *) NULL;
-    pemInternalObject **temp = (pemInternalObject **) NULL;
-    NSSCKFWSlot *fwSlot;
-    CK_SLOT_ID slotID;
-
-    plog("pem_FindObjectsInit\n");
-    fwSlot = NSSCKFWSession_GetFWSlot(fwSession);
-    if ((NSSCKFWSlot *) NULL == fwSlot) {
-        goto loser;
-    }
-    slotID = NSSCKFWSlot_GetSlotID(fwSlot);
-
-    arena = NSSArena_Create();
-    if ((NSSArena *) NULL == arena) {
-        goto loser;
-    }
-
-    rv = NSS_ZNEW(arena, NSSCKMDFindObjects);
-    if ((NSSCKMDFindObjects *) NULL == rv) {
-        *pError = CKR_HOST_MEMORY;
-        goto loser;
-    }
-
-    fo = NSS_ZNEW(arena, struct pemFOStr);
-    if ((struct pemFOStr *) NULL == fo) {
-        *pError = CKR_HOST_MEMORY;
-        goto loser;
+        fo->done = PR_TRUE; /* no other object types we understand in this module */
+        break;
     }
 
-    fo->arena = arena;
-    /* fo->n and fo->i are already zero */
-
-    rv->etc = (void *) fo;
-    rv->Final = pem_mdFindObjects_Final;
-    rv->Next = pem_mdFindObjects_Next;
-    rv->null = (void *) NULL;
-
-    fo->n =
-        collect_objects(pTemplate, ulAttributeCount, &temp, pError,
-                        slotID);
-    if (*pError != CKR_OK) {
-        goto loser;
+    if (!fo->store) {
+        /* nothing loaded into this slot */
+        fo->done = PR_TRUE;
     }
 
-    fo->objs = NSS_ZNEWARRAY(arena, pemInternalObject *, fo->n);
-    if ((pemInternalObject **) NULL == fo->objs) {
-        *pError = CKR_HOST_MEMORY;
-        goto loser;
+    if (!fo->done && !pem_FilterMayMatch(slotID, objClass, fo->pTemplate,
+                                         ulAttributeCount)) {
+        plog("pem_FindObjectsInit: rejected by the slot filter\n");
+        fo->done = PR_TRUE;
     }
 
-    memcpy(fo->objs, temp, sizeof(pemInternalObject *) * fo->n);
-
-    NSS_ZFreeIf(temp);
-    temp = (pemInternalObject **) NULL;
-
-    return rv;
+    pem_StatsRecord(pemStatFindObjectsInit, start);
+    return &fo->mdFindObjects;
 
   loser:
-    NSS_ZFreeIf(temp);
-    NSS_ZFreeIf(fo);
-    NSS_ZFreeIf(rv);
-    if ((NSSArena *) NULL != arena) {
-        NSSArena_Destroy(arena);
-    }
+    if (fo)
+        pem_FreeFindObjects(fo);
+    pem_StatsRecord(pemStatFindObjectsInit, start);
     return (NSSCKMDFindObjects *) NULL;
 }
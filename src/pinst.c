@@ -39,6 +39,8 @@
 
 #include <blapi.h>
 
+#include <glob.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 /*
@@ -50,8 +52,11 @@
 
 static PRBool pemInitialized = PR_FALSE;
 
-LIST_HEAD(pem_objs);
 long pem_nobjs = 0L;
+
+/* indexed by slotID, NULL for slots that never had any object */
+static pemSlotStore **pem_slotStores;
+static CK_SLOT_ID pem_nslotStores;
 int token_needsLogin[NUM_SLOTS];
 NSSCKMDSlot *lastEventSlot;
 
@@ -181,38 +186,738 @@ GetCertFields(unsigned char *cert, int cert_length,
     return SECSuccess;
 }
 
+/* the OID of rsaEncryption, 1.2.840.113549.1.1.1 */
+static const unsigned char rsaEncryptionOID[] = {
+    0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01
+};
+
+/* the content of the next element of buf if it has the expected tag */
+static unsigned char *
+dataStartTag(unsigned char *buf, unsigned int length,
+             unsigned int *data_length, unsigned char expected)
+{
+    unsigned char tag;
+    unsigned char *data = dataStart(buf, length, data_length, PR_FALSE, &tag);
+
+    return (data && tag == expected) ? data : NULL;
+}
+
+static void
+stripLeadingZeros(SECItem *item)
+{
+    while (item->len > 1 && item->data[0] == 0) {
+        item->data++;
+        item->len--;
+    }
+}
+
+/* read two consecutive INTEGERs, the modulus and exponent of an RSA key */
+static SECStatus
+GetModulusExponent(unsigned char *buf, unsigned int buf_length,
+                   SECItem *modulus, SECItem *exponent)
+{
+    modulus->data = dataStartTag(buf, buf_length, &modulus->len, 0x02);
+    if (modulus->data == NULL)
+        return SECFailure;
+    buf_length -= (modulus->data - buf) + modulus->len;
+    buf = modulus->data + modulus->len;
+
+    exponent->data = dataStartTag(buf, buf_length, &exponent->len, 0x02);
+    if (exponent->data == NULL)
+        return SECFailure;
+
+    stripLeadingZeros(modulus);
+    stripLeadingZeros(exponent);
+    return SECSuccess;
+}
+
+/*
+ * Find the public key in a DER encoded SubjectPublicKeyInfo.  For RSA keys
+ * pub is set to the modulus and exponent to the public exponent, for other
+ * keys pub is set to the content of the BIT STRING and exponent is empty.
+ * Both point into spki.
+ */
+static SECStatus
+GetPublicKeyFromSPKI(unsigned char *spki, unsigned int spki_length,
+                     SECItem *pub, SECItem *exponent)
+{
+    unsigned char *buf, *alg, *oid, *bits, *rsa;
+    unsigned int buf_length, alg_length, oid_length, bits_length, rsa_length;
+
+    buf = dataStartTag(spki, spki_length, &buf_length, 0x30);
+    if (buf == NULL)
+        return SECFailure;
+    alg = dataStartTag(buf, buf_length, &alg_length, 0x30);
+    if (alg == NULL)
+        return SECFailure;
+    oid = dataStartTag(alg, alg_length, &oid_length, 0x06);
+    if (oid == NULL)
+        return SECFailure;
+    buf_length -= (alg - buf) + alg_length;
+    buf = alg + alg_length;
+
+    /* the first byte of the BIT STRING is the number of unused bits */
+    bits = dataStartTag(buf, buf_length, &bits_length, 0x03);
+    if (bits == NULL || bits_length < 2)
+        return SECFailure;
+    bits++;
+    bits_length--;
+    exponent->data = NULL;
+    exponent->len = 0;
+
+    if (oid_length == sizeof rsaEncryptionOID
+            && 0 == memcmp(oid, rsaEncryptionOID, oid_length)) {
+        /* RSAPublicKey ::= SEQUENCE { modulus INTEGER, exponent INTEGER } */
+        rsa = dataStartTag(bits, bits_length, &rsa_length, 0x30);
+        if (rsa == NULL)
+            return SECFailure;
+        return GetModulusExponent(rsa, rsa_length, pub, exponent);
+    }
+
+    pub->data = bits;
+    pub->len = bits_length;
+    return SECSuccess;
+}
+
+/*
+ * Find the modulus and public exponent in a DER encoded RSAPrivateKey or in a
+ * PrivateKeyInfo (PKCS #8) that wraps one.  Fails on encrypted keys.  Both
+ * point into key.
+ */
+static SECStatus
+GetModulusFromPrivateKey(unsigned char *key, unsigned int key_length,
+                         SECItem *modulus, SECItem *exponent)
+{
+    unsigned char *buf, *version, *next, *wrapped;
+    unsigned int buf_length, version_length, next_length, wrapped_length;
+
+    buf = dataStartTag(key, key_length, &buf_length, 0x30);
+    if (buf == NULL)
+        return SECFailure;
+    version = dataStartTag(buf, buf_length, &version_length, 0x02);
+    if (version == NULL)
+        return SECFailure;
+    buf_length -= (version - buf) + version_length;
+    buf = version + version_length;
+    if (buf_length == 0)
+        return SECFailure;
+
+    if (buf[0] == 0x30) {
+        /* PrivateKeyInfo: skip the algorithm and unwrap the OCTET STRING */
+        next = dataStartTag(buf, buf_length, &next_length, 0x30);
+        if (next == NULL)
+            return SECFailure;
+        buf_length -= (next - buf) + next_length;
+        buf = next + next_length;
+        wrapped = dataStartTag(buf, buf_length, &wrapped_length, 0x04);
+        if (wrapped == NULL || wrapped_length == 0 || wrapped[0] != 0x30)
+            return SECFailure;
+        return GetModulusFromPrivateKey(wrapped, wrapped_length, modulus,
+                                        exponent);
+    }
+
+    return GetModulusExponent(buf, buf_length, modulus, exponent);
+}
+
+/* find the public key of a DER encoded certificate, see GetPublicKeyFromSPKI */
+static SECStatus
+GetPublicKeyFromCert(unsigned char *cert, unsigned int cert_length,
+                     SECItem *pub, SECItem *exponent)
+{
+    SECItem issuer, serial, derSN, subject, valid, subjkey;
+
+    if (SECSuccess != GetCertFields(cert, cert_length, &issuer, &serial,
+                                    &derSN, &subject, &valid, &subjkey))
+        return SECFailure;
+
+    return GetPublicKeyFromSPKI(subjkey.data, subjkey.len, pub, exponent);
+}
+
+SECStatus
+pem_ParseCertFields(pemInternalObject *io)
+{
+    SECItem subject;
+    SECItem issuer;
+    SECItem serial;
+    SECItem derSN;
+    SECItem valid;
+    SECItem subjkey;
+    pemCertObject *co = &io->u.cert;
+
+    if (co->fieldsParsed)
+        return SECSuccess;
+
+    if (SECSuccess != GetCertFields(io->derCert->data, io->derCert->len,
+                                    &issuer, &serial, &derSN, &subject,
+                                    &valid, &subjkey)) {
+        plog("pem_ParseCertFields: malformed certificate %s\n", io->nickname);
+        return SECFailure;
+    }
+
+    /* the items point into derCert, the blob shared by the objects of the
+     * certificate, which lives as long as the object */
+    co->subject.data = subject.data;
+    co->subject.size = subject.len;
+    co->issuer.data = issuer.data;
+    co->issuer.size = issuer.len;
+    co->serial.data = serial.data;
+    co->serial.size = serial.len;
+    co->fieldsParsed = PR_TRUE;
+    return SECSuccess;
+}
+
+/*
+ * Return the objects of the given slot.  If the slot has no objects yet, a
+ * new empty store is created if create is set, NULL is returned otherwise.
+ */
+pemSlotStore *
+pem_GetSlotStore(CK_SLOT_ID slotID, PRBool create)
+{
+    pemSlotStore *store;
+
+    if (slotID < pem_nslotStores && pem_slotStores[slotID])
+        return pem_slotStores[slotID];
+
+    if (!create)
+        return NULL;
+
+    if (slotID >= pem_nslotStores) {
+        CK_SLOT_ID count = pem_nslotStores ? pem_nslotStores : NUM_SLOTS + 1;
+        pemSlotStore **stores;
+
+        while (count <= slotID)
+            count <<= 1;
+
+        stores = NSS_ZNEWARRAY(NULL, pemSlotStore *, count);
+        if (!stores)
+            return NULL;
+        if (pem_slotStores)
+            memcpy(stores, pem_slotStores,
+                   pem_nslotStores * sizeof(pemSlotStore *));
+        NSS_ZFreeIf(pem_slotStores);
+        pem_slotStores = stores;
+        pem_nslotStores = count;
+    }
+
+    store = NSS_ZNEW(NULL, pemSlotStore);
+    if (!store)
+        return NULL;
+
+    pem_slotStores[slotID] = store;
+    return store;
+}
+
+/* hash of CKA_ID kept in pemHotObject, 32-bit FNV-1a */
+PRUint32
+pem_HashId(const NSSItem *id)
+{
+    const unsigned char *p = id->data;
+    PRUint32 h = 0x811c9dc5;
+    PRUint32 i;
+
+    for (i = 0; i < id->size; i++) {
+        h ^= p[i];
+        h *= 0x01000193;
+    }
+    return h;
+}
+
+/* return the index of the first entry of store with arrayIdx > given one */
+long
+pem_SlotStoreSeek(const pemSlotStore *store, long arrayIdx)
+{
+    long lo = 0, hi = store->nentries;
+
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (store->objs[mid].arrayIdx <= arrayIdx)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static pemHotObject *
+slotStoreLookup(const pemSlotStore *store, const pemInternalObject *o)
+{
+    long i = pem_SlotStoreSeek(store, o->arrayIdx - 1);
+
+    if (i < store->nentries && store->objs[i].io == o)
+        return &store->objs[i];
+    return NULL;
+}
+
+/* make sure that slotStoreAppend() cannot fail for the next object */
 static CK_RV
-assignObjectID(pemInternalObject *o, const long objid)
+slotStoreReserve(pemSlotStore *store)
+{
+    pemHotObject *objs;
+    long capacity;
+
+    if (store->nentries < store->capacity)
+        return CKR_OK;
+
+    capacity = store->capacity ? 2 * store->capacity : 64;
+    objs = NSS_ZNEWARRAY(NULL, pemHotObject, capacity);
+    if (!objs)
+        return CKR_HOST_MEMORY;
+    if (store->objs)
+        memcpy(objs, store->objs, store->nentries * sizeof(pemHotObject));
+    NSS_ZFreeIf(store->objs);
+    store->objs = objs;
+    store->capacity = capacity;
+    return CKR_OK;
+}
+
+static void
+slotStoreAppend(pemSlotStore *store, pemInternalObject *o)
+{
+    pemHotObject *hot = &store->objs[store->nentries++];
+
+    hot->arrayIdx = o->arrayIdx;
+    hot->io = o;
+    hot->objClass = o->objClass;
+    hot->type = o->type;
+    hot->idHash = pem_HashId(&o->id);
+    store->nobjs++;
+}
+
+static void
+slotStoreRemove(pemSlotStore *store, pemInternalObject *o)
+{
+    pemHotObject *hot = slotStoreLookup(store, o);
+    long i, n = 0;
+
+    if (!hot)
+        return;
+
+    hot->io = NULL;
+    store->nobjs--;
+    if (store->nobjs >= store->nentries / 2)
+        return;
+
+    /* more holes than objects, squeeze them out */
+    for (i = 0; i < store->nentries; i++) {
+        if (store->objs[i].io)
+            store->objs[n++] = store->objs[i];
+    }
+    memset(&store->objs[n], 0, (store->nentries - n) * sizeof(pemHotObject));
+    store->nentries = n;
+    store->generation++;
+}
+
+static void
+freeSlotStores(void)
+{
+    CK_SLOT_ID i;
+
+    for (i = 0; i < pem_nslotStores; i++) {
+        if (pem_slotStores[i])
+            NSS_ZFreeIf(pem_slotStores[i]->objs);
+        NSS_ZFreeIf(pem_slotStores[i]);
+    }
+    NSS_ZFreeIf(pem_slotStores);
+    pem_slotStores = NULL;
+    pem_nslotStores = 0;
+}
+
+/*
+ * Objects in the slot stores are also indexed by arrayIdx in a dense table and
+ * by CKA_ID in a chained hash table, so that they can be looked up without
+ * walking the stores.  CKA_ID is derived from the public key (see
+ * assignKeyID()), thus the ID index is also what pairs certificates with their
+ * keys, whatever order they are loaded in.  Objects are only indexed while
+ * they are in a store.
+ *
+ * A third index holds the objects by content (see contentHash()), so that
+ * AddObjectIfNeeded() finds an object loaded again without a scan of the slot.
+ */
+static pemInternalObject **pem_objTable;
+static long pem_objTableSize;
+
+static pemInternalObject **pem_idBuckets;
+static unsigned long pem_idMask;        /* number of buckets - 1 */
+static long pem_idEntries;
+
+static pemInternalObject **pem_contentBuckets;
+static unsigned long pem_contentMask;   /* number of buckets - 1 */
+static long pem_contentEntries;
+
+static unsigned long
+idBucket(const NSSItem *id)
+{
+    return pem_HashId(id) & pem_idMask;
+}
+
+static void
+idLink(pemInternalObject *o)
+{
+    pemInternalObject **bucket = &pem_idBuckets[idBucket(&o->id)];
+
+    o->idNext = *bucket;
+    *bucket = o;
+    pem_idEntries++;
+}
+
+static void
+idUnlink(pemInternalObject *o)
+{
+    pemInternalObject **pp = &pem_idBuckets[idBucket(&o->id)];
+
+    for (; *pp; pp = &(*pp)->idNext) {
+        if (*pp == o) {
+            *pp = o->idNext;
+            o->idNext = NULL;
+            pem_idEntries--;
+            return;
+        }
+    }
+}
+
+/* keep the load factor of the ID index at most 1 after one more entry */
+static CK_RV
+idReserve(void)
+{
+    pemInternalObject **old = pem_idBuckets;
+    unsigned long oldCount = old ? pem_idMask + 1 : 0;
+    unsigned long count = oldCount ? oldCount : 64;
+    unsigned long i;
+
+    if (old && pem_idEntries + 1 < (long) oldCount)
+        return CKR_OK;
+
+    while (count <= (unsigned long) pem_idEntries + 1)
+        count <<= 1;
+
+    pem_idBuckets = NSS_ZNEWARRAY(NULL, pemInternalObject *, count);
+    if (!pem_idBuckets) {
+        pem_idBuckets = old;
+        return CKR_HOST_MEMORY;
+    }
+    pem_idMask = count - 1;
+    pem_idEntries = 0;
+
+    for (i = 0; i < oldCount; i++) {
+        pemInternalObject *o = old[i];
+        while (o) {
+            pemInternalObject *next = o->idNext;
+            idLink(o);
+            o = next;
+        }
+    }
+    NSS_ZFreeIf(old);
+    return CKR_OK;
+}
+
+/*
+ * Hash of what derEncodingsMatch() compares, mixed with the slot and class:
+ * the DER encoding of certificates and trust objects, the fingerprint of keys.
+ */
+static PRUint32
+contentHash(CK_OBJECT_CLASS objClass, CK_SLOT_ID slotID,
+            const SECItem *certDER, const pemKeyParams *keyKP)
+{
+    NSSItem item;
+
+    if (CKO_PRIVATE_KEY == objClass) {
+        item.data = (void *) keyKP->fingerprint;
+        item.size = sizeof keyKP->fingerprint;
+    } else {
+        item.data = certDER->data;
+        item.size = certDER->len;
+    }
+    return pem_HashId(&item) ^ (PRUint32) objClass
+        ^ ((PRUint32) slotID * 0x9e3779b9);
+}
+
+static void
+contentLink(pemInternalObject *o)
+{
+    pemInternalObject **bucket =
+        &pem_contentBuckets[o->contentHash & pem_contentMask];
+
+    o->contentNext = *bucket;
+    *bucket = o;
+    pem_contentEntries++;
+}
+
+static void
+contentUnlink(pemInternalObject *o)
+{
+    pemInternalObject **pp =
+        &pem_contentBuckets[o->contentHash & pem_contentMask];
+
+    for (; *pp; pp = &(*pp)->contentNext) {
+        if (*pp == o) {
+            *pp = o->contentNext;
+            o->contentNext = NULL;
+            pem_contentEntries--;
+            return;
+        }
+    }
+}
+
+/* keep the load factor of the content index at most 1 after one more entry */
+static CK_RV
+contentReserve(void)
+{
+    pemInternalObject **old = pem_contentBuckets;
+    unsigned long oldCount = old ? pem_contentMask + 1 : 0;
+    unsigned long count = oldCount ? oldCount : 64;
+    unsigned long i;
+
+    if (old && pem_contentEntries + 1 < (long) oldCount)
+        return CKR_OK;
+
+    while (count <= (unsigned long) pem_contentEntries + 1)
+        count <<= 1;
+
+    pem_contentBuckets = NSS_ZNEWARRAY(NULL, pemInternalObject *, count);
+    if (!pem_contentBuckets) {
+        pem_contentBuckets = old;
+        return CKR_HOST_MEMORY;
+    }
+    pem_contentMask = count - 1;
+    pem_contentEntries = 0;
+
+    for (i = 0; i < oldCount; i++) {
+        pemInternalObject *o = old[i];
+        while (o) {
+            pemInternalObject *next = o->contentNext;
+            contentLink(o);
+            o = next;
+        }
+    }
+    NSS_ZFreeIf(old);
+    return CKR_OK;
+}
+
+/* make sure that indexObject() cannot fail for the next object */
+static CK_RV
+reserveIndexes(void)
+{
+    if (pem_nobjs >= pem_objTableSize) {
+        long size = pem_objTableSize ? pem_objTableSize : 256;
+        pemInternalObject **table;
+
+        while (size <= pem_nobjs)
+            size <<= 1;
+
+        table = NSS_ZNEWARRAY(NULL, pemInternalObject *, size);
+        if (!table)
+            return CKR_HOST_MEMORY;
+        if (pem_objTable)
+            memcpy(table, pem_objTable,
+                   pem_objTableSize * sizeof(pemInternalObject *));
+        NSS_ZFreeIf(pem_objTable);
+        pem_objTable = table;
+        pem_objTableSize = size;
+    }
+
+    if (CKR_OK != idReserve())
+        return CKR_HOST_MEMORY;
+    return contentReserve();
+}
+
+/* add a new object of a slot store to the indexes */
+static void
+indexObject(pemInternalObject *o)
+{
+    pem_objTable[o->arrayIdx] = o;
+    idLink(o);
+    contentLink(o);
+}
+
+/* remove an object that is being destroyed from its slot store and the
+ * indexes */
+void
+pem_UnindexObject(pemInternalObject *io)
+{
+    pemSlotStore *store = pem_GetSlotStore(io->slotID, PR_FALSE);
+
+    if (0 <= io->arrayIdx && io->arrayIdx < pem_objTableSize
+        && pem_objTable[io->arrayIdx] == io) {
+        pem_objTable[io->arrayIdx] = NULL;
+        idUnlink(io);
+        contentUnlink(io);
+        if (store) {
+            if (store->lastCert == io)
+                store->lastCert = NULL;
+            if (store->unpairedKey == io)
+                store->unpairedKey = NULL;
+            slotStoreRemove(store, io);
+        }
+    }
+}
+
+/* return the most recently added object with the given ID, slot and type */
+pemInternalObject *
+pem_FindObjectById(const NSSItem *id, CK_SLOT_ID slotID, pemObjectType type)
+{
+    pemInternalObject *o, *found = NULL;
+
+    if (!pem_idBuckets)
+        return NULL;
+
+    for (o = pem_idBuckets[idBucket(id)]; o; o = o->idNext) {
+        if (o->slotID == slotID && o->type == type
+            && o->id.size == id->size
+            && 0 == memcmp(o->id.data, id->data, id->size)
+            && (!found || found->arrayIdx < o->arrayIdx))
+            found = o;
+    }
+    return found;
+}
+
+/*
+ * Return the certificate most recently added to the slot if no key has been
+ * paired with it yet.  A key whose public key is not known (encrypted in
+ * legacy PEM format) is assumed to belong to it.
+ */
+pemInternalObject *
+pem_FindUnpairedCert(CK_SLOT_ID slotID)
+{
+    pemSlotStore *store = pem_GetSlotStore(slotID, PR_FALSE);
+    pemInternalObject *cert = store ? store->lastCert : NULL;
+
+    if (!cert || pem_FindObjectById(&cert->id, slotID, pemBareKey))
+        return NULL;
+    return cert;
+}
+
+static void
+freeIndexes(void)
+{
+    NSS_ZFreeIf(pem_objTable);
+    pem_objTable = NULL;
+    pem_objTableSize = 0;
+    NSS_ZFreeIf(pem_idBuckets);
+    pem_idBuckets = NULL;
+    pem_idMask = 0;
+    pem_idEntries = 0;
+    NSS_ZFreeIf(pem_contentBuckets);
+    pem_contentBuckets = NULL;
+    pem_contentMask = 0;
+    pem_contentEntries = 0;
+}
+
+/*
+ * Release all objects, including those still referenced by the framework.
+ * Every object of a slot store is in pem_objTable, the objects are freed from
+ * there before the indexes and stores go away.
+ */
+static void
+releaseObjects(void)
+{
+    long i;
+
+    for (i = 0; i < pem_objTableSize; i++) {
+        if (pem_objTable[i])
+            pem_FreeInternalObject(pem_objTable[i]);
+    }
+
+    freeIndexes();
+    freeSlotStores();
+    pem_CapathReset();
+    pem_BlobReset();
+    pem_nobjs = 0L;
+
+    /* no certificate borrows from the snapshots any more */
+    pem_SnapshotRelease();
+}
+
+/*
+ * Set CKA_ID the way NSS derives it from a public key, which is the SHA-1
+ * hash of the RSA modulus (or of the whole public key for other key types).
+ * NSS then finds the key of a certificate by the ID it computes itself.
+ */
+static CK_RV
+assignKeyID(pemInternalObject *o, const SECItem *pub)
+{
+    o->id.data = NSS_ZAlloc(NULL, SHA1_LENGTH);
+    if (o->id.data == NULL)
+        return CKR_HOST_MEMORY;
+
+    if (SECSuccess != SHA1_HashBuf(o->id.data, pub->data, pub->len)) {
+        NSS_ZFreeIf(o->id.data);
+        o->id.data = NULL;
+        return CKR_GENERAL_ERROR;
+    }
+    o->id.size = SHA1_LENGTH;
+    o->idFromKey = PR_TRUE;
+    return CKR_OK;
+}
+
+/*
+ * Objects whose public key is not known, i.e. keys encrypted in legacy PEM
+ * format without a certificate, get a CKA_ID unique among the loaded objects
+ * (in decimal) until they are paired with a certificate.
+ */
+static CK_RV
+assignSerialID(pemInternalObject *o)
 {
     char id[24];
     int len;
 
-    sprintf(id, "%ld", objid);
+    sprintf(id, "%ld", pem_nobjs + 1);
     len = strlen(id) + 1;       /* zero terminate */
-    o->id.size = len;
     o->id.data = NSS_ZAlloc(NULL, len);
     if (o->id.data == NULL)
         return CKR_HOST_MEMORY;
 
     memcpy(o->id.data, id, len);
-    o->objid = objid;
+    o->id.size = len;
     return CKR_OK;
 }
 
+/*
+ * Pair the key whose public key is not known, if any, with a certificate that
+ * has just been added to the slot (or re-used) and has no key yet.  The key
+ * takes the CKA_ID of the certificate.  CA certificates are never paired with
+ * keys, they do not get here.
+ */
+static void
+pairUnknownKey(pemSlotStore *store, pemInternalObject *cert)
+{
+    pemInternalObject *key = store->unpairedKey;
+    void *id;
+
+    store->lastCert = cert;
+    if (!key || !cert->idFromKey
+        || pem_FindObjectById(&cert->id, cert->slotID, pemBareKey))
+        return;
+
+    id = NSS_ZAlloc(NULL, cert->id.size);
+    if (id == NULL)
+        return;
+    memcpy(id, cert->id.data, cert->id.size);
+
+    /* the filter counts the old ID until it is replaced */
+    pem_FilterRemove(key);
+    idUnlink(key);
+    NSS_ZFreeIf(key->id.data);
+    key->id.data = id;
+    key->id.size = cert->id.size;
+    key->idFromKey = PR_TRUE;
+    idLink(key);
+    store->unpairedKey = NULL;
+
+    pem_FilterAdd(key);
+    slotStoreLookup(store, key)->idHash = pem_HashId(&key->id);
+}
+
 static pemInternalObject *
 CreateObject(CK_OBJECT_CLASS objClass,
              pemObjectType type, SECItem * certDER,
              SECItem * keyDER, const char *filename,
-             long objid, CK_SLOT_ID slotID)
+             CK_SLOT_ID slotID)
 {
     pemInternalObject *o;
-    SECItem subject;
-    SECItem issuer;
-    SECItem serial;
-    SECItem derSN;
-    SECItem valid;
-    SECItem subjkey;
     const char *nickname;
+    SECItem pub, exponent;
+    SECItem issuer, serial, derSN, subject, valid, subjkey;
+    SECStatus found = SECFailure;
 
     o = NSS_ZNEW(NULL, pemInternalObject);
     if ((pemInternalObject *) NULL == o) {
@@ -227,17 +932,17 @@ CreateObject(CK_OBJECT_CLASS objClass,
 
     switch (objClass) {
     case CKO_CERTIFICATE:
-        plog("Creating cert nick %s id %ld in slot %ld\n", nickname, objid, slotID);
+        plog("Creating cert nick %s in slot %ld\n", nickname, slotID);
         memset(&o->u.cert, 0, sizeof(o->u.cert));
         break;
     case CKO_PRIVATE_KEY:
-        plog("Creating key id %ld in slot %ld\n", objid, slotID);
+        plog("Creating key in slot %ld\n", slotID);
         memset(&o->u.key, 0, sizeof(o->u.key));
         /* more unique nicknames - https://bugzilla.redhat.com/689031#c66 */
         nickname = filename;
         break;
     case CKO_NSS_TRUST:
-        plog("Creating trust nick %s id %ld in slot %ld\n", nickname, objid, slotID);
+        plog("Creating trust nick %s in slot %ld\n", nickname, slotID);
         memset(&o->u.trust, 0, sizeof(o->u.trust));
         break;
     }
@@ -247,53 +952,45 @@ CreateObject(CK_OBJECT_CLASS objClass,
         goto fail;
     strcpy(o->nickname, nickname);
 
-    if (CKR_OK != assignObjectID(o, objid))
+    /* derive CKA_ID from the public key if we can find it */
+    switch (objClass) {
+    case CKO_PRIVATE_KEY:
+        found = GetModulusFromPrivateKey(keyDER->data, keyDER->len, &pub,
+                                         &exponent);
+        /* the key is encrypted, use the certificate it comes with (if any) */
+        if (SECSuccess != found && certDER->len)
+            found = GetPublicKeyFromCert(certDER->data, certDER->len, &pub,
+                                         &exponent);
+        break;
+    case CKO_CERTIFICATE:
+    case CKO_NSS_TRUST:
+        /* reject certificates whose fields cannot be found right away rather
+         * than missing their attributes later; the fields themselves are only
+         * kept by pem_ParseCertFields() on first use */
+        if (SECSuccess != GetCertFields(certDER->data, certDER->len, &issuer,
+                                        &serial, &derSN, &subject, &valid,
+                                        &subjkey)) {
+            plog("CreateObject: malformed certificate %s\n", nickname);
+            goto fail;
+        }
+        found = GetPublicKeyFromSPKI(subjkey.data, subjkey.len, &pub,
+                                     &exponent);
+        break;
+    }
+    if (CKR_OK != (SECSuccess == found ? assignKeyID(o, &pub)
+                                       : assignSerialID(o)))
         goto fail;
 
     o->objClass = objClass;
     o->type = type;
     o->slotID = slotID;
 
-    o->derCert = NSS_ZNEW(NULL, SECItem);
+    /* shared with all other objects of the same certificate */
+    o->derCert = pem_BlobGet(certDER);
     if (o->derCert == NULL)
         goto fail;
-    o->derCert->data = (void *) NSS_ZAlloc(NULL, certDER->len);
-    if (o->derCert->data == NULL)
-        goto fail;
-    o->derCert->len = certDER->len;
-    memcpy(o->derCert->data, certDER->data, certDER->len);
 
     switch (objClass) {
-    case CKO_CERTIFICATE:
-    case CKO_NSS_TRUST:
-        if (SECSuccess != GetCertFields(o->derCert->data, o->derCert->len,
-                                        &issuer, &serial, &derSN, &subject,
-                                        &valid, &subjkey))
-            goto fail;
-
-        o->u.cert.subject.data = (void *) NSS_ZAlloc(NULL, subject.len);
-        if (o->u.cert.subject.data == NULL)
-            goto fail;
-        o->u.cert.subject.size = subject.len;
-        memcpy(o->u.cert.subject.data, subject.data, subject.len);
-
-        o->u.cert.issuer.data = (void *) NSS_ZAlloc(NULL, issuer.len);
-        if (o->u.cert.issuer.data == NULL) {
-            NSS_ZFreeIf(o->u.cert.subject.data);
-            goto fail;
-        }
-        o->u.cert.issuer.size = issuer.len;
-        memcpy(o->u.cert.issuer.data, issuer.data, issuer.len);
-
-        o->u.cert.serial.data = (void *) NSS_ZAlloc(NULL, serial.len);
-        if (o->u.cert.serial.data == NULL) {
-            NSS_ZFreeIf(o->u.cert.issuer.data);
-            NSS_ZFreeIf(o->u.cert.subject.data);
-            goto fail;
-        }
-        o->u.cert.serial.size = serial.len;
-        memcpy(o->u.cert.serial.data, serial.data, serial.len);
-        break;
     case CKO_PRIVATE_KEY:
         o->u.key.key.privateKey = NSS_ZNEW(NULL, SECItem);
         if (o->u.key.key.privateKey == NULL)
@@ -302,19 +999,21 @@ CreateObject(CK_OBJECT_CLASS objClass,
             (void *) NSS_ZAlloc(NULL, keyDER->len);
         if (o->u.key.key.privateKey->data == NULL) {
             NSS_ZFreeIf(o->u.key.key.privateKey);
-            goto fail;
-        }
-
-        /* store deep copy of original key DER so we can compare it later on */
-        o->u.key.key.privateKeyOrig = SECITEM_DupItem(keyDER);
-        if (o->u.key.key.privateKeyOrig == NULL) {
-            NSS_ZFreeIf(o->u.key.key.privateKey->data);
-            NSS_ZFreeIf(o->u.key.key.privateKey);
+            o->u.key.key.privateKey = NULL;
             goto fail;
         }
 
         o->u.key.key.privateKey->len = keyDER->len;
         memcpy(o->u.key.key.privateKey->data, keyDER->data, keyDER->len);
+
+        /* remember the original key DER so we can compare it later on */
+        if (SECSuccess != pem_FingerprintKey(&o->u.key.key, keyDER))
+            goto fail;
+
+        /* serve the public key attributes without decoding the private key */
+        if (SECSuccess == found && exponent.len
+            && CKR_OK != pem_SetPublicKey(&o->u.key.key, &pub, &exponent))
+            goto fail;
     }
 
 
@@ -322,10 +1021,9 @@ CreateObject(CK_OBJECT_CLASS objClass,
 
 fail:
     if (o) {
-        if (o->derCert) {
-            NSS_ZFreeIf(o->derCert->data);
-            NSS_ZFreeIf(o->derCert);
-        }
+        if (CKO_PRIVATE_KEY == objClass)
+            pem_DestroyKeyParams(&o->u.key.key);
+        pem_BlobRelease(o->derCert);
         NSS_ZFreeIf(o->id.data);
         NSS_ZFreeIf(o->nickname);
         NSS_ZFreeIf(o);
@@ -334,70 +1032,43 @@ fail:
 }
 
 /* Compare the DER encoding of the internal object against those
- * of the provided certDER or keyDER according to its objClass.
+ * of the provided certDER or keyDER according to its objClass.  Keys
+ * are compared by the fingerprint of their DER encoding as loaded,
+ * keyKP holds the fingerprint of keyDER.
  */
 static PRBool
 derEncodingsMatch(CK_OBJECT_CLASS objClass, pemInternalObject * obj,
-                  SECItem * certDER, SECItem * keyDER)
+                  SECItem * certDER, const pemKeyParams * keyKP)
 {
-    SECComparison result;
+    const pemKeyParams *kp;
 
     switch (objClass) {
     case CKO_CERTIFICATE:
     case CKO_NSS_TRUST:
-        result = SECITEM_CompareItem(obj->derCert, certDER);
-        break;
+        return SECEqual == SECITEM_CompareItem(obj->derCert, certDER);
 
     case CKO_PRIVATE_KEY:
-        result = SECITEM_CompareItem(obj->u.key.key.privateKeyOrig, keyDER);
-        break;
+        kp = &obj->u.key.key;
+        return (kp->fingerprintLen == keyKP->fingerprintLen)
+            && !memcmp(kp->fingerprint, keyKP->fingerprint,
+                       sizeof kp->fingerprint);
 
     default:
         /* unhandled object class */
         return PR_FALSE;
     }
-
-    return SECEqual == result;
-}
-
-static CK_RV
-LinkSharedKeyObject(const long oldKeyIdx, const long newKeyIdx)
-{
-    pemInternalObject *obj;
-    list_for_each_entry(obj, &pem_objs, gl_list) {
-        CK_RV rv;
-        if (obj->objid != oldKeyIdx)
-            continue;
-
-        NSS_ZFreeIf(obj->id.data);
-        rv = assignObjectID(obj, newKeyIdx);
-        if (CKR_OK != rv)
-            return rv;
-    }
-
-    return CKR_OK;
-}
-
-/* return pointer to the internal object with given arrayIdx */
-static pemInternalObject *
-FindObjectByArrayIdx(const long arrayIdx)
-{
-    pemInternalObject *obj;
-
-    list_for_each_entry(obj, &pem_objs, gl_list)
-        if (arrayIdx == obj->arrayIdx)
-            return obj;
-
-    return NULL;
 }
 
 pemInternalObject *
 AddObjectIfNeeded(CK_OBJECT_CLASS objClass,
                   pemObjectType type, SECItem * certDER,
                   SECItem * keyDER, const char *filename,
-                  long objid, CK_SLOT_ID slotID, PRBool *pAdded)
+                  CK_SLOT_ID slotID, PRBool cacert, PRBool *pAdded)
 {
     pemInternalObject *curObj;
+    pemSlotStore *store;
+    pemKeyParams keyKP;
+    PRUint32 hash;
 
     const char *nickname = strrchr(filename, '/');
     if (nickname
@@ -410,54 +1081,66 @@ AddObjectIfNeeded(CK_OBJECT_CLASS objClass,
     if (pAdded)
         *pAdded = PR_FALSE;
 
-    /* first look for the object in pem_objs, it might be already there */
-    list_for_each_entry(curObj, &pem_objs, gl_list) {
+    /* hash the key only once, not for each object we compare it with; keys
+     * which cannot be told apart from others must not be added */
+    if (CKO_PRIVATE_KEY == objClass
+            && SECSuccess != pem_FingerprintKey(&keyKP, keyDER)) {
+        plog("AddObjectIfNeeded: cannot fingerprint the key\n");
+        return NULL;
+    }
+
+    store = pem_GetSlotStore(slotID, PR_TRUE);
+    if (!store)
+        return NULL;
+
+    /* first look for the object in the slot, it might be already there */
+    hash = contentHash(objClass, slotID, certDER, &keyKP);
+    curObj = pem_contentBuckets ? pem_contentBuckets[hash & pem_contentMask]
+                                : NULL;
+    for (; curObj; curObj = curObj->contentNext) {
         /* Comparing DER encodings is dependable and frees the PEM module
          * from having to require clients to provide unique nicknames.
          */
-        if ((curObj->objClass == objClass)
-                && (curObj->type == type)
+        if ((curObj->contentHash == hash)
                 && (curObj->slotID == slotID)
-                && derEncodingsMatch(objClass, curObj, certDER, keyDER)) {
-
-            /* While adding a client certificate we (wrongly?) assumed that the
-             * key object will follow right after the cert object.  However, if
-             * the key object is shared by multiple client certificates, such
-             * an assumption does not hold.  We have to update the references.
-             */
-            LinkSharedKeyObject(pem_nobjs, curObj->arrayIdx);
-
-            if (CKO_CERTIFICATE == objClass) {
-                const long ref = curObj->objid;
-                if (0 < ref && ref < pem_nobjs && !FindObjectByArrayIdx(ref)) {
-                    /* The certificate we are going to reuse refers to an
-                     * object that has already been removed.  Make it refer
-                     * to the object that will be added next (private key).
-                     */
-                    NSS_ZFreeIf(curObj->id.data);
-                    assignObjectID(curObj, pem_nobjs);
-                }
-            }
+                && (curObj->objClass == objClass)
+                && (curObj->type == type)
+                && derEncodingsMatch(objClass, curObj, certDER, &keyKP)) {
+            if (CKO_CERTIFICATE == objClass && !cacert)
+                pairUnknownKey(store, curObj);
 
             plog("AddObjectIfNeeded: re-using internal object #%li\n",
                  curObj->arrayIdx);
             curObj->refCount ++;
+            pem_Trace(PEM_TRACE_OBJECT, pemTraceObjectReuse,
+                      curObj->arrayIdx, curObj->refCount);
             return curObj;
         }
     }
 
     /* object not found, we need to create it */
+    if (CKR_OK != reserveIndexes() || CKR_OK != slotStoreReserve(store))
+        return NULL;
+
     pemInternalObject *io = CreateObject(objClass, type, certDER, keyDER,
-                                         filename, objid, slotID);
+                                         filename, slotID);
     if (io == NULL)
         return NULL;
 
     /* initialize pointers to functions */
     pem_CreateMDObject(NULL, io, NULL);
 
-    /* add object to global list */
+    /* add object to the slot */
     io->arrayIdx = pem_nobjs++;
-    list_add_tail(&io->gl_list, &pem_objs);
+    io->contentHash = hash;
+    slotStoreAppend(store, io);
+    indexObject(io);
+    pem_FilterAdd(io);
+    if (CKO_CERTIFICATE == objClass && !cacert)
+        pairUnknownKey(store, io);
+    else if (CKO_PRIVATE_KEY == objClass && !io->idFromKey)
+        store->unpairedKey = io;
+    pem_Trace(PEM_TRACE_OBJECT, pemTraceObjectCreate, io->arrayIdx, objClass);
 
     if (pAdded)
         *pAdded = PR_TRUE;
@@ -472,7 +1155,6 @@ AddCertificate(char *certfile, char *keyfile, PRBool cacert,
 {
     pemInternalObject *o = NULL;
     CK_RV error = 0;
-    long objid;
     int i = 0;
     SECItem **objs = NULL;
     char *ivstring = NULL;
@@ -489,16 +1171,15 @@ AddCertificate(char *certfile, char *keyfile, PRBool cacert,
     if (cacert) {
         for (i = 0; i < nobjs; i++) {
             char nickname[1024];
-            objid = pem_nobjs + 1;
 
             snprintf(nickname, sizeof nickname, "%s - %d", certfile, i);
 
             o = AddObjectIfNeeded(CKO_CERTIFICATE, pemCert, objs[i], NULL,
-                                   nickname, 0, slotID, NULL);
+                                   nickname, slotID, PR_TRUE, NULL);
             if (o != NULL) {
                 /* Add the CA trust object */
                 o = AddObjectIfNeeded(CKO_NSS_TRUST, pemTrust, objs[i], NULL,
-                                       nickname, 0, slotID, NULL);
+                                       nickname, slotID, PR_TRUE, NULL);
             }
             if (o == NULL) {
                 error = CKR_GENERAL_ERROR;
@@ -508,9 +1189,8 @@ AddCertificate(char *certfile, char *keyfile, PRBool cacert,
     } else {
         PRBool found_error = PR_FALSE;
 
-        objid = pem_nobjs + 1;
         o = AddObjectIfNeeded(CKO_CERTIFICATE, pemCert, objs[0], NULL, certfile,
-                              objid, slotID, NULL);
+                              slotID, PR_FALSE, NULL);
 
         if (o != NULL && keyfile != NULL) { /* add the private key */
             SECItem **keyobjs = NULL;
@@ -519,9 +1199,21 @@ AddCertificate(char *certfile, char *keyfile, PRBool cacert,
             if (kobjs < 1) {
                 found_error = PR_TRUE;
             } else {
+                PRBool added;
+
                 o = AddObjectIfNeeded(CKO_PRIVATE_KEY, pemBareKey, objs[0],
-                                      keyobjs[0], certfile, objid, slotID, NULL);
+                                      keyobjs[0], certfile, slotID, PR_FALSE,
+                                      &added);
+                if (o != NULL && added) {
+                    /* the key owns the IV from now on */
+                    o->u.key.ivstring = ivstring;
+                    o->u.key.cipher = cipher;
+                    ivstring = NULL;
+                }
             }
+
+            /* NSS_ZFreeIf() wipes the key material before releasing it */
+            FreeDERList(keyobjs, kobjs);
         }
 
         if (found_error || o == NULL) {
@@ -530,12 +1222,15 @@ AddCertificate(char *certfile, char *keyfile, PRBool cacert,
         }
     }
 
-    NSS_ZFreeIf(objs);
+    if (ivstring)
+        PORT_ZFree(ivstring, strlen(ivstring));
+    FreeDERList(objs, nobjs);
     return CKR_OK;
 
   loser:
-    NSS_ZFreeIf(objs);
-    NSS_ZFreeIf(o);
+    if (ivstring)
+        PORT_ZFree(ivstring, strlen(ivstring));
+    FreeDERList(objs, nobjs);
     return error;
 }
 
@@ -599,7 +1294,7 @@ pem_FreeDynPtrList(DynPtrList *dpl)
 void*
 pem_AddToDynPtrList(DynPtrList *dpl, char *ptr)
 {
-    const size_t max_size_t = ((size_t) -1);
+    const size_t max_capacity = ((size_t) -1) / sizeof(void*);
 
     if (!dpl->capacity)
         return NULL; /* dpl not initialized */
@@ -609,8 +1304,8 @@ pem_AddToDynPtrList(DynPtrList *dpl, char *ptr)
         void **new_pointers = NULL;
         size_t new_capacity;
 
-        if ( (((double)max_size_t) / dpl->capacity) < DynPtrList_default_realloc_factor) {
-            new_capacity = max_size_t;
+        if (max_capacity / dpl->capacity < DynPtrList_default_realloc_factor) {
+            new_capacity = max_capacity;
         } else {
             new_capacity = dpl->capacity * DynPtrList_default_realloc_factor;
         }
@@ -619,8 +1314,10 @@ pem_AddToDynPtrList(DynPtrList *dpl, char *ptr)
             return NULL; /* cannot grow */
         }
 
-        new_pointers = (*dpl->realloc_function)(dpl->pointers, new_capacity);
-        if (new_pointers == dpl->pointers) {
+        /* the realloc function takes bytes, not pointers */
+        new_pointers = (*dpl->realloc_function)(dpl->pointers,
+                                                new_capacity * sizeof(void*));
+        if (!new_pointers) {
             return NULL; /* cannot grow */
         }
 
@@ -633,12 +1330,237 @@ pem_AddToDynPtrList(DynPtrList *dpl, char *ptr)
     return ptr;
 }
 
-CK_RV
-pem_Initialize
+/* trace parameters are read by open_nss_pem_log() */
+static PRBool
+isTraceParameter(const char *entry)
+{
+    return !strncmp(entry, "trace=", 6) || !strncmp(entry, "tracefile=", 10);
+}
+
+/*
+ * Read the files of all configuration entries in parallel before the
+ * entries are processed one by one, see pem_FilePrefetch().  Certificate
+ * files are left out if snapshots may serve them.
+ */
+static void
+prefetchFiles(DynPtrList *certstrings)
+{
+    const char **names;
+    int count = 0;
+    int i, j;
+
+    names = NSS_ZNEWARRAY(NULL, const char *, 2 * certstrings->entries);
+    if (!names)
+        return;
+
+    for (i = 0; i < certstrings->entries; i++) {
+        char *cert = (char*)certstrings->pointers[i];
+        DynPtrList certattrs;
+
+        if (!strncmp(cert, "capath=", 7) || !strncmp(cert, "config=", 7)
+                || isTraceParameter(cert))
+            continue;
+
+        pem_InitDynPtrList(&certattrs, myDynPtrListAllocWrapper,
+                          myDynPtrListReallocWrapper, myDynPtrListFreeWrapper);
+        if (pem_ParseString(cert, ';', &certattrs)) {
+            for (j = 0; j < certattrs.entries && j < 2; j++) {
+                if (0 == j && pem_SnapshotEnabled())
+                    continue;
+                /* take the string over from the list */
+                names[count++] = certattrs.pointers[j];
+                certattrs.pointers[j] = NULL;
+            }
+        }
+        pem_FreeDynPtrList(&certattrs);
+    }
+
+    pem_FilePrefetch(names, count);
+
+    for (i = 0; i < count; i++)
+        NSS_ZFreeIf((char *) names[i]);
+    NSS_ZFreeIf(names);
+}
+
+/* certificate (and key) files of a configuration file, see loadConfigFile() */
+typedef struct pemConfigEntryStr {
+    char        *cert;
+    char        *key;           /* NULL for CA certificates */
+    CK_SLOT_ID  slotID;
+} pemConfigEntry;
+
+#define PEM_CONFIG_BATCH 64
+
+static char *
+configStrdup(const char *str)
+{
+    char *copy = NSS_ZAlloc(NULL, strlen(str) + 1);
+
+    if (copy)
+        strcpy(copy, str);
+    return copy;
+}
+
+/*
+ * Load a batch of entries of a configuration file, prefetched in parallel,
+ * and drop the files decoded for them so that the cache does not grow with
+ * the number of entries.
+ */
+static CK_RV
+flushConfigBatch(pemConfigEntry *batch, int *count)
+{
+    const char *names[2 * PEM_CONFIG_BATCH];
+    CK_RV rv = CKR_OK;
+    int nnames = 0;
+    int i;
+
+    for (i = 0; i < *count; i++) {
+        if (!pem_SnapshotEnabled())
+            names[nnames++] = batch[i].cert;
+        if (batch[i].key)
+            names[nnames++] = batch[i].key;
+    }
+    pem_FilePrefetch(names, nnames);
+
+    for (i = 0; i < *count; i++) {
+        if (CKR_OK == rv) {
+            rv = AddCertificate(batch[i].cert, batch[i].key, !batch[i].key,
+                                batch[i].slotID);
+            if (CKR_OK != rv)
+                plog("cannot load %s\n", batch[i].cert);
+        }
+        NSS_ZFreeIf(batch[i].cert);
+        NSS_ZFreeIf(batch[i].key);
+    }
+    *count = 0;
+
+    pem_FileCacheEnd();
+    pem_FileCacheBegin();
+    return rv;
+}
+
+/* queue an entry of a configuration file, taking over cert and key */
+static CK_RV
+addConfigEntry(pemConfigEntry *batch, int *count, char *cert, char *key,
+               CK_SLOT_ID slotID)
+{
+    if (!cert) {
+        NSS_ZFreeIf(key);
+        return CKR_HOST_MEMORY;
+    }
+    batch[*count].cert = cert;
+    batch[*count].key = key;
+    batch[*count].slotID = slotID;
+    if (++(*count) < PEM_CONFIG_BATCH)
+        return CKR_OK;
+    return flushConfigBatch(batch, count);
+}
+
+/*
+ * Load the entries of a configuration file (config=FILE in the module
+ * parameters), one per line:
+ *
+ *  cert[;key] [slot=N]
+ *  capath=DIR [slot=N]
+ *
+ * Lines starting with # are comments.  The certificate of a line without a
+ * key may be a glob(3) pattern, which adds all matching files as CA
+ * certificates.  Entries go into the slot of the config= parameter unless
+ * they name another one.  The file is read in a single pass and loaded in
+ * batches of PEM_CONFIG_BATCH entries.
+ */
+static CK_RV
+loadConfigFile(const char *filename, CK_SLOT_ID defaultSlot)
+{
+    pemConfigEntry batch[PEM_CONFIG_BATCH];
+    int count = 0;
+    char *line = NULL;
+    size_t size = 0;
+    int lineno = 0;
+    CK_RV rv = CKR_OK;
+    FILE *fp;
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        plog("cannot open configuration file %s\n", filename);
+        return CKR_GENERAL_ERROR;
+    }
+
+    while (CKR_OK == rv && getline(&line, &size, fp) >= 0) {
+        CK_SLOT_ID slotID = defaultSlot;
+        char *path, *opt, *key, *save;
+
+        lineno++;
+        path = strtok_r(line, " \t\r\n", &save);
+        if (!path || '#' == *path)
+            continue;
+
+        while ((opt = strtok_r(NULL, " \t\r\n", &save))) {
+            char *end;
+
+            if (strncmp(opt, "slot=", 5)) {
+                rv = CKR_ARGUMENTS_BAD;
+                break;
+            }
+            slotID = strtoul(opt + 5, &end, 10);
+            if (end == opt + 5 || *end || slotID > NUM_SLOTS) {
+                rv = CKR_ARGUMENTS_BAD;
+                break;
+            }
+        }
+        if (CKR_OK != rv) {
+            plog("%s:%d: bad option %s\n", filename, lineno, opt);
+            break;
+        }
+
+        if (!strncmp(path, "capath=", 7)) {
+            /* keep the order of the entries */
+            rv = flushConfigBatch(batch, &count);
+            if (CKR_OK == rv)
+                rv = pem_CapathAdd(path + 7, slotID);
+            continue;
+        }
+
+        key = strchr(path, ';');
+        if (key) {
+            *key++ = '\0';
+            rv = addConfigEntry(batch, &count, configStrdup(path),
+                                configStrdup(key), slotID);
+        } else if (strpbrk(path, "*?[")) {
+            glob_t g;
+            size_t i;
+
+            if (0 == glob(path, 0, NULL, &g)) {
+                for (i = 0; i < g.gl_pathc && CKR_OK == rv; i++)
+                    rv = addConfigEntry(batch, &count,
+                                        configStrdup(g.gl_pathv[i]), NULL,
+                                        slotID);
+                globfree(&g);
+            }
+        } else {
+            rv = addConfigEntry(batch, &count, configStrdup(path), NULL,
+                                slotID);
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    if (CKR_OK == rv) {
+        rv = flushConfigBatch(batch, &count);
+    } else {
+        while (count > 0) {
+            count--;
+            NSS_ZFreeIf(batch[count].cert);
+            NSS_ZFreeIf(batch[count].key);
+        }
+    }
+    return rv;
+}
+
+static CK_RV
+pem_LoadConfiguration
 (
-    NSSCKMDInstance * mdInstance,
-    NSSCKFWInstance * fwInstance,
-    NSSUTF8 * configurationData
+    NSSCKFWInstance * fwInstance
 )
 {
     CK_RV rv;
@@ -663,7 +1585,8 @@ pem_Initialize
 
     RNG_RNGInit();
 
-    open_nss_pem_log();
+    open_nss_pem_log(modArgs ? (const char *) modArgs->LibraryParameters
+                             : NULL);
 
     plog("pem_Initialize\n");
 
@@ -680,23 +1603,52 @@ pem_Initialize
      * entry of the pair is the path to the certificate file. The
      * second is the path to the key file.
      *
-     * CA certificates do not need the semi-colon.
+     * CA certificates do not need the semi-colon.  A directory of CA
+     * certificates named by subject hash (see pcapath.c) is given as
+     * capath=DIR.  Long lists of entries can be kept in a file given as
+     * config=FILE, see loadConfigFile().  Tracing is configured by
+     * trace=CATEGORIES and tracefile=FILE, see ptrace.c.
      *
      * Example:
      *  /etc/certs/server.pem;/etc/certs/server.key /etc/certs/ca.pem
+     *  capath=/etc/ssl/certs config=/etc/pki/nss-pem.conf
+     *  trace=init,find tracefile=/var/log/nss-pem.trace
      *
      */
     pem_InitDynPtrList(&certstrings, myDynPtrListAllocWrapper,
                       myDynPtrListReallocWrapper, myDynPtrListFreeWrapper);
     status = pem_ParseString(modparms, ' ', &certstrings);
     if (status == PR_FALSE) {
+        releaseObjects();
         return CKR_ARGUMENTS_BAD;
     }
 
+    /* files referenced more than once are decoded only once */
+    pem_FileCacheBegin();
+    prefetchFiles(&certstrings);
     for (i = 0; i < certstrings.entries && error != PR_TRUE; i++) {
         char *cert = (char*)certstrings.pointers[i];
         DynPtrList certattrs;
 
+        if (!strncmp(cert, "capath=", 7)) {
+            if (pem_CapathAdd(cert + 7, i) != CKR_OK) {
+                error = PR_TRUE;
+                status = PR_FALSE;
+            }
+            continue;
+        }
+
+        if (!strncmp(cert, "config=", 7)) {
+            if (loadConfigFile(cert + 7, i) != CKR_OK) {
+                error = PR_TRUE;
+                status = PR_FALSE;
+            }
+            continue;
+        }
+
+        if (isTraceParameter(cert))
+            continue;
+
         pem_InitDynPtrList(&certattrs, myDynPtrListAllocWrapper,
                           myDynPtrListReallocWrapper, myDynPtrListFreeWrapper);
         status = pem_ParseString(cert, ';', &certattrs);
@@ -719,9 +1671,12 @@ pem_Initialize
         }
         pem_FreeDynPtrList(&certattrs);
     }
+    pem_FileCacheEnd();
     pem_FreeDynPtrList(&certstrings);
 
+    pem_Trace(PEM_TRACE_INIT, pemTraceInitialize, i, status);
     if (status == PR_FALSE) {
+        releaseObjects();
         return CKR_ARGUMENTS_BAD;
     }
 
@@ -735,6 +1690,21 @@ pem_Initialize
     return CKR_OK;
 }
 
+CK_RV
+pem_Initialize
+(
+    NSSCKMDInstance * mdInstance,
+    NSSCKFWInstance * fwInstance,
+    NSSUTF8 * configurationData
+)
+{
+    PRIntervalTime start = PR_IntervalNow();
+    CK_RV rv = pem_LoadConfiguration(fwInstance);
+
+    pem_StatsRecord(pemStatInitialize, start);
+    return rv;
+}
+
 void
 pem_Finalize
 (
@@ -746,8 +1716,12 @@ pem_Finalize
     if (!pemInitialized)
         return;
 
-    INIT_LIST_HEAD(&pem_objs);
-    pem_nobjs = 0L;
+    pem_Trace(PEM_TRACE_INIT, pemTraceFinalize, pem_nobjs, 0);
+    pem_StatsFinalize();
+    pem_DestroyStatsObjects();
+    pem_FilterReset();
+    releaseObjects();
+    close_nss_pem_log();
 
     PR_AtomicSet(&pemInitialized, PR_FALSE);
 }
@@ -820,8 +1794,9 @@ pem_mdInstance_GetSlots
     int i;
     CK_RV pError;
 
+    /* NSSCKFW numbers the slots from 1 in this order */
     for (i = 0; i < NUM_SLOTS; i++) {
-        slots[i] = (NSSCKMDSlot *) pem_NewSlot(fwInstance, &pError);
+        slots[i] = (NSSCKMDSlot *) pem_NewSlot(fwInstance, i + 1, &pError);
         if (pError != CKR_OK)
             return pError;
     }
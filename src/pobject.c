@@ -142,6 +142,18 @@ const CK_ATTRIBUTE_TYPE trustAttrs[] = {
 };
 const PRUint32 trustAttrsCount = NSS_PEM_ARRAY_SIZE(trustAttrs);
 
+/* Statistics */
+const CK_ATTRIBUTE_TYPE statsAttrs[] = {
+    CKA_CLASS,
+    CKA_TOKEN,
+    CKA_PRIVATE,
+    CKA_MODIFIABLE,
+    CKA_LABEL,
+    CKA_VALUE,
+    CKA_PEM_TRACE
+};
+const PRUint32 statsAttrsCount = NSS_PEM_ARRAY_SIZE(statsAttrs);
+
 static const CK_BBOOL ck_true = CK_TRUE;
 static const CK_BBOOL ck_false = CK_FALSE;
 static const CK_CERTIFICATE_TYPE ckc_x509 = CKC_X_509;
@@ -150,6 +162,7 @@ static const CK_OBJECT_CLASS cko_certificate = CKO_CERTIFICATE;
 static const CK_OBJECT_CLASS cko_private_key = CKO_PRIVATE_KEY;
 static const CK_OBJECT_CLASS cko_public_key = CKO_PUBLIC_KEY;
 static const CK_OBJECT_CLASS cko_trust = CKO_NSS_TRUST;
+static const CK_OBJECT_CLASS cko_pem_stats = CKO_PEM_STATS;
 static const CK_TRUST ckt_netscape_trusted = CKT_NSS_TRUSTED_DELEGATOR;
 static const NSSItem pem_trueItem = {
     (void *) &ck_true, (PRUint32) sizeof(CK_BBOOL)
@@ -175,6 +188,12 @@ static const NSSItem pem_pubKeyClassItem = {
 static const NSSItem pem_trustClassItem = {
     (void *) &cko_trust, (PRUint32) sizeof(CK_OBJECT_CLASS)
 };
+static const NSSItem pem_statsClassItem = {
+    (void *) &cko_pem_stats, (PRUint32) sizeof(CK_OBJECT_CLASS)
+};
+static const NSSItem pem_statsLabelItem = {
+    (void *) "PEM statistics", (PRUint32) sizeof("PEM statistics") - 1
+};
 static const NSSItem pem_emptyItem = {
     (void *) &ck_true, 0
 };
@@ -252,12 +271,18 @@ const NSSItem
         plog("  fetch cert CKA_LABEL %s\n", io->u.cert.label.data);
         return &io->u.cert.label;
     case CKA_SUBJECT:
+        if (SECSuccess != pem_ParseCertFields(io))
+            return NULL;
         plog("  fetch cert CKA_SUBJECT size %d\n", io->u.cert.subject.size);
         return &io->u.cert.subject;
     case CKA_ISSUER:
+        if (SECSuccess != pem_ParseCertFields(io))
+            return NULL;
         plog("  fetch cert CKA_ISSUER size %d\n", io->u.cert.issuer.size);
         return &io->u.cert.issuer;
     case CKA_SERIAL_NUMBER:
+        if (SECSuccess != pem_ParseCertFields(io))
+            return NULL;
         plog("  fetch cert CKA_SERIAL_NUMBER size %d value %08x\n", io->u.cert.serial.size, io->u.cert.serial.data);
         return &io->u.cert.serial;
     case CKA_VALUE:
@@ -268,8 +293,7 @@ const NSSItem
         plog("  fetch cert CKA_VALUE\n");
         return &io->u.cert.derCert;
     case CKA_ID:
-        plog("  fetch cert CKA_ID val=%s size=%d\n", (char *) io->id.data,
-             io->id.size);
+        plog("  fetch cert CKA_ID size=%d\n", io->id.size);
         return &io->id;
     case CKA_TRUSTED:
         plog("  fetch cert CKA_TRUSTED: returning NULL\n");
@@ -290,7 +314,7 @@ pem_FetchPrivKeyAttribute
 )
 {
     PRBool isCertType = (pemCert == io->type);
-    pemKeyParams *kp = isCertType ? &io->u.cert.key : &io->u.key.key;
+    pemKeyParams *kp = &io->u.key.key;
 
     switch (type) {
     case CKA_CLASS:
@@ -325,6 +349,8 @@ pem_FetchPrivKeyAttribute
         if (!isCertType) {
             return &pem_emptyItem;
         }
+        if (SECSuccess != pem_ParseCertFields(io))
+            return NULL;
         plog("  fetch key CKA_SUBJECT %s\n", io->u.cert.label.data);
         return &io->u.cert.subject;
     case CKA_MODULUS:
@@ -400,8 +426,7 @@ pem_FetchPrivKeyAttribute
         plog("  fetch key CKA_COEFFICIENT_2\n");
         return &kp->coefficient;
     case CKA_ID:
-        plog("  fetch key CKA_ID val=%s size=%d\n", (char *) io->id.data,
-             io->id.size);
+        plog("  fetch key CKA_ID size=%d\n", io->id.size);
         return &io->id;
     default:
         return NULL;
@@ -416,7 +441,7 @@ pem_FetchPubKeyAttribute
 )
 {
     PRBool isCertType = (pemCert == io->type);
-    pemKeyParams *kp = isCertType ? &io->u.cert.key : &io->u.key.key;
+    pemKeyParams *kp = &io->u.key.key;
 
     switch (type) {
     case CKA_CLASS:
@@ -446,6 +471,8 @@ pem_FetchPubKeyAttribute
         if (!isCertType) {
             return &pem_emptyItem;
         }
+        if (SECSuccess != pem_ParseCertFields(io))
+            return NULL;
         return &io->u.cert.subject;
     case CKA_MODULUS:
         if (0 == kp->modulus.size) {
@@ -494,16 +521,19 @@ pem_FetchTrustAttribute
         plog("  fetch trust CKA_SUBJECT\n");
         return NULL;
     case CKA_ISSUER:
+        if (SECSuccess != pem_ParseCertFields(io))
+            return NULL;
         plog("  fetch trust CKA_ISSUER\n");
         return &io->u.cert.issuer;
     case CKA_SERIAL_NUMBER:
+        if (SECSuccess != pem_ParseCertFields(io))
+            return NULL;
         plog("  fetch trust CKA_SERIAL_NUMBER size %d value %08x\n", io->u.cert.serial.size, io->u.cert.serial.data);
         return &io->u.cert.serial;
     case CKA_VALUE:
         return &pem_trueItem;
     case CKA_ID:
-        plog("  fetch trust CKA_ID val=%s size=%d\n", (char *) io->id.data,
-             io->id.size);
+        plog("  fetch trust CKA_ID size=%d\n", io->id.size);
         return &io->id;
     case CKA_TRUSTED:
         return &pem_trusted;
@@ -554,6 +584,148 @@ pem_FetchTrustAttribute
     return NULL;
 }
 
+static const NSSItem *
+pem_FetchStatsAttribute
+(
+    pemInternalObject * io,
+    CK_ATTRIBUTE_TYPE type
+)
+{
+    switch (type) {
+    case CKA_CLASS:
+        return &pem_statsClassItem;
+    case CKA_TOKEN:
+        return &pem_trueItem;
+    case CKA_PRIVATE:
+    case CKA_MODIFIABLE:
+        return &pem_falseItem;
+    case CKA_LABEL:
+        return &pem_statsLabelItem;
+    default:
+        break;
+    }
+    return NULL;
+}
+
+/*
+ * Attributes of the statistics object that are formatted into a new item on
+ * each read, see pem_FormatReportAttribute().
+ */
+static PRBool
+pem_IsReportAttribute
+(
+    pemInternalObject * io,
+    CK_ATTRIBUTE_TYPE type
+)
+{
+    return pemStats == io->type
+        && (CKA_VALUE == type || CKA_PEM_TRACE == type);
+}
+
+/* upper bound of the size of a report attribute */
+static PRUint32
+pem_ReportAttributeSize
+(
+    CK_ATTRIBUTE_TYPE type
+)
+{
+    switch (type) {
+    case CKA_VALUE:
+        /* fixed, so the size asked for first stays valid */
+        return pem_StatsReportSize();
+    case CKA_PEM_TRACE:
+        return pem_TraceReportSize();
+    default:
+        break;
+    }
+    return 0;
+}
+
+/*
+ * Format a report attribute into a new item, released by
+ * pem_mdObject_FreeAttribute().  The item is private to the caller, so
+ * concurrent reads do not share a buffer.
+ */
+static NSSItem *
+pem_FormatReportAttribute
+(
+    CK_ATTRIBUTE_TYPE type,
+    CK_RV * pError
+)
+{
+    PRUint32 size = pem_ReportAttributeSize(type);
+    NSSItem *item;
+
+    item = NSS_ZAlloc(NULL, sizeof(NSSItem) + size + 1);
+    if (!item) {
+        *pError = CKR_HOST_MEMORY;
+        return NULL;
+    }
+    item->data = item + 1;
+
+    switch (type) {
+    case CKA_VALUE:
+        pem_StatsReport(item->data);
+        item->size = size;
+        break;
+    case CKA_PEM_TRACE:
+        item->size = pem_TraceReport(item->data, size);
+        break;
+    default:
+        break;
+    }
+    return item;
+}
+
+/* slot statistics objects, created on first lookup */
+static pemInternalObject *pem_statsObjects[NUM_SLOTS + 1];
+
+/*
+ * Return the object exposing the module statistics in the given slot.  The
+ * object is not kept in the slot store and lives until pem_DestroyStatsObjects().
+ */
+pemInternalObject *
+pem_GetStatsObject
+(
+    CK_SLOT_ID slotID
+)
+{
+    pemInternalObject *io;
+
+    if (slotID > NUM_SLOTS)
+        return NULL;
+
+    io = pem_statsObjects[slotID];
+    if (io)
+        return io;
+
+    io = NSS_ZNEW(NULL, pemInternalObject);
+    if (!io)
+        return NULL;
+
+    io->type = pemStats;
+    io->objClass = CKO_PEM_STATS;
+    io->slotID = slotID;
+    io->arrayIdx = -1;
+    io->refCount = 1;
+
+    pem_statsObjects[slotID] = io;
+    return io;
+}
+
+void
+pem_DestroyStatsObjects(void)
+{
+    int i;
+
+    for (i = 0; i <= NUM_SLOTS; i++) {
+        if (pem_statsObjects[i]) {
+            NSS_ZFreeIf(pem_statsObjects[i]);
+            pem_statsObjects[i] = NULL;
+        }
+    }
+}
+
 const NSSItem *
 pem_FetchAttribute
 (
@@ -582,6 +754,8 @@ pem_FetchAttribute
         return pem_FetchTrustAttribute(io, type);
     case CKO_PUBLIC_KEY:
         return pem_FetchPubKeyAttribute(io, type);
+    case CKO_PEM_STATS:
+        return pem_FetchStatsAttribute(io, type);
     }
     return NULL;
 }
@@ -620,62 +794,55 @@ pem_DestroyInternalObject
     if (0 < io->refCount)
         return;
 
-    /* destroy internal object */
+    /* while the keys of the object are still there */
+    pem_FilterRemove(io);
+
+    if (pemRaw == io->type || pemStats == io->type)
+        /* statistics objects are released by pem_DestroyStatsObjects() */
+        return;
+
+    pem_Trace(PEM_TRACE_OBJECT, pemTraceObjectDestroy, io->arrayIdx,
+              io->objClass);
+
+    /* remove self from the slot while the ID can still be hashed */
+    pem_UnindexObject(io);
+    pem_FreeInternalObject(io);
+}
+
+/*
+ * Free an object of a slot store along with what it owns, whatever its
+ * reference count.  The object must no longer be indexed unless all indexes
+ * are about to be dropped, see releaseObjects().
+ */
+void
+pem_FreeInternalObject
+(
+    pemInternalObject * io
+)
+{
     switch (io->type) {
     case pemRaw:
+    case pemStats:
+    case pemAll:
+        /* not kept in slot stores */
         return;
     case pemCert:
-        NSS_ZFreeIf(io->u.cert.key.privateKey);
-        NSS_ZFreeIf(io->u.cert.key.pubKey);
-        /* go through */
     case pemTrust:
-        NSS_ZFreeIf(io->id.data);
-        NSS_ZFreeIf(io->nickname);
-        NSS_ZFreeIf(io->derCert->data);
-        NSS_ZFreeIf(io->derCert);
-        if (io->u.cert.subject.size > 0) {
-            NSS_ZFreeIf(io->u.cert.subject.data);
-        }
-        if (io->u.cert.issuer.size > 0) {
-            NSS_ZFreeIf(io->u.cert.issuer.data);
-        }
-        if (io->u.cert.serial.size > 0) {
-            NSS_ZFreeIf(io->u.cert.serial.data);
-        }
+        /* subject, issuer and serial point into derCert */
         break;
     case pemBareKey:
-        SECITEM_FreeItem(io->u.key.key.privateKeyOrig, PR_TRUE);
-        NSS_ZFreeIf(io->u.key.key.coefficient.data);
-        NSS_ZFreeIf(io->u.key.key.exponent2.data);
-        NSS_ZFreeIf(io->u.key.key.exponent1.data);
-        NSS_ZFreeIf(io->u.key.key.prime2.data);
-        NSS_ZFreeIf(io->u.key.key.prime1.data);
-        NSS_ZFreeIf(io->u.key.key.privateExponent.data);
-        NSS_ZFreeIf(io->u.key.key.exponent.data);
-        NSS_ZFreeIf(io->u.key.key.modulus.data);
-        NSS_ZFreeIf(io->u.key.key.privateKey->data);
-        NSS_ZFreeIf(io->u.key.key.privateKey);
-        NSS_ZFreeIf(io->u.key.key.pubKey);
-        NSS_ZFreeIf(io->id.data);
-        NSS_ZFreeIf(io->nickname);
-        NSS_ZFreeIf(io->derCert->data);
-        NSS_ZFreeIf(io->derCert);
+        pem_DestroyKeyParams(&io->u.key.key);
 
         /* PORT_Strdup'd in ReadDERFromFile */
         if (io->u.key.ivstring)
-            PORT_Free(io->u.key.ivstring);
+            PORT_ZFree(io->u.key.ivstring, strlen(io->u.key.ivstring));
         break;
-    case pemAll:
-        /* pemAll is not used, keep the compiler happy
-         * TODO: investigate a proper solution
-         */
-        return;
     }
 
-    /* remove self from the global list */
-    list_del(&io->gl_list);
+    NSS_ZFreeIf(io->id.data);
+    NSS_ZFreeIf(io->nickname);
+    pem_BlobRelease(io->derCert);
     NSS_ZFreeIf(io);
-    return;
 }
 
 /*
@@ -777,6 +944,8 @@ pem_mdObject_GetAttributeCount
         return privKeyAttrsCount;
     case CKO_NSS_TRUST:
         return trustAttrsCount;
+    case CKO_PEM_STATS:
+        return statsAttrsCount;
     default:
         break;
     }
@@ -832,6 +1001,9 @@ pem_mdObject_GetAttributeTypes
         case CKO_PRIVATE_KEY:
             attrs = privKeyAttrs;
             break;
+        case CKO_PEM_STATS:
+            attrs = statsAttrs;
+            break;
         default:
             return CKR_OK;
         }
@@ -869,6 +1041,9 @@ pem_mdObject_GetAttributeSize
                                     attribute, pError);
     }
 
+    if (pem_IsReportAttribute(io, attribute))
+        return pem_ReportAttributeSize(attribute);
+
     b = pem_FetchAttribute(io, attribute, pError);
     plog("pem_FetchAttribute pError = 0x%08x\n", *pError);
 
@@ -904,6 +1079,7 @@ pem_mdObject_GetAttribute
 {
     NSSCKFWItem mdItem;
     pemInternalObject *io = (pemInternalObject *) mdObject->etc;
+    PRIntervalTime start;
 
     if (NULL != io->list) {
         /* list object --> use the first item in the list */
@@ -913,16 +1089,37 @@ pem_mdObject_GetAttribute
                                 attribute, pError);
     }
 
-    mdItem.needsFreeing = PR_FALSE;
-    mdItem.item = (NSSItem *) pem_FetchAttribute(io, attribute, pError);
+    start = PR_IntervalNow();
+    pem_Trace(PEM_TRACE_ATTR, pemTraceAttrFetch, io->arrayIdx, attribute);
+    if (pem_IsReportAttribute(io, attribute)) {
+        mdItem.needsFreeing = PR_TRUE;
+        mdItem.item = pem_FormatReportAttribute(attribute, pError);
+    } else {
+        mdItem.needsFreeing = PR_FALSE;
+        mdItem.item = (NSSItem *) pem_FetchAttribute(io, attribute, pError);
+    }
 
     if ((NSSItem *) NULL == mdItem.item && !*pError) {
         *pError = CKR_ATTRIBUTE_TYPE_INVALID;
     }
 
+    pem_StatsRecord(pemStatGetAttribute, start);
+
     return mdItem;
 }
 
+/* release an item returned by pem_mdObject_GetAttribute() with needsFreeing */
+static CK_RV
+pem_mdObject_FreeAttribute
+(
+    NSSCKFWItem * item
+)
+{
+    NSS_ZFreeIf(item->item);
+    item->item = NULL;
+    return CKR_OK;
+}
+
 /*
  * get an attribute from a template. Value is returned in NSS item.
  * data for the item is owned by the template.
@@ -1041,7 +1238,7 @@ pem_prototype_mdObject = {
     pem_mdObject_GetAttributeTypes,
     pem_mdObject_GetAttributeSize,
     pem_mdObject_GetAttribute,
-    NULL,                       /* FreeAttribute */
+    pem_mdObject_FreeAttribute,
     NULL,                       /* SetAttribute */
     NULL,                       /* GetObjectSize */
     (void *) NULL               /* null terminator */
@@ -1063,6 +1260,27 @@ pem_CreateMDObject
     return &io->mdObject;
 }
 
+/*
+ * Read the certificates or keys given in CKA_VALUE, PEM or DER encoded, or
+ * from the file named by CKA_LABEL if there is no value.
+ */
+static int
+pem_ReadTemplateDER
+(
+    SECItem *** derlist,
+    const NSSItem * value,
+    char *filename,
+    int *cipher,
+    char **ivstring,
+    PRBool certsonly
+)
+{
+    if (value->data)
+        return pem_ReadDERFromBuffer(derlist, value->data, value->size,
+                                     cipher, ivstring, certsonly);
+    return ReadDERFromFile(derlist, filename, cipher, ivstring, certsonly);
+}
+
 /*
  * Each object has an identifier. For a certificate and key pair this id
  * needs to be the same so we use the right combination. If the target object
@@ -1085,10 +1303,9 @@ pem_CreateObject
     CK_SLOT_ID slotID;
     CK_BBOOL cacert;
     char *filename;
+    NSSItem value;
     SECItem **derlist = NULL;
     int nobjs = 0;
-    int i;
-    long objid;
     int cipher = 0;
     char *ivstring = NULL;
     pemInternalObject *listObj = NULL;
@@ -1121,6 +1338,13 @@ pem_CreateObject
         return (NSSCKMDObject *) NULL;
     }
 
+    /* the object may be passed in memory, CKA_LABEL then only names it */
+    if (CKR_OK != pem_GetAttribute(CKA_VALUE, pTemplate, ulAttributeCount,
+                                   &value)) {
+        value.data = NULL;
+        value.size = 0;
+    }
+
 #ifdef notdef
     if (objClass == CKO_PUBLIC_KEY) {
         return CKR_OK;  /* fake public key creation, happens as a side effect of
@@ -1142,20 +1366,16 @@ pem_CreateObject
     }
 
     if (objClass == CKO_CERTIFICATE) {
-        nobjs = ReadDERFromFile(&derlist, filename, &cipher, &ivstring,
-                                /* certs only */ PR_TRUE);
+        nobjs = pem_ReadTemplateDER(&derlist, &value, filename, &cipher,
+                                    &ivstring, /* certs only */ PR_TRUE);
         if (nobjs < 1)
             goto loser;
 
-        /* We're just adding a cert, we'll assume the key is next */
-        objid = pem_nobjs + 1;
-
         if (cacert) {
             /* Add the certificate. There may be more than one */
             int c;
             for (c = 0; c < nobjs; c++) {
                 char nickname[1024];
-                objid = pem_nobjs + 1;
 
                 snprintf(nickname, sizeof nickname, "%s - %d", filename, c);
 
@@ -1163,22 +1383,22 @@ pem_CreateObject
                     APPEND_LIST_ITEM(listItem);
                 }
                 listItem->io = AddObjectIfNeeded(CKO_CERTIFICATE, pemCert,
-                                                 derlist[c], NULL, nickname, 0,
-                                                 slotID, NULL);
+                                                 derlist[c], NULL, nickname,
+                                                 slotID, PR_TRUE, NULL);
                 if (listItem->io != NULL) {
                     /* Add the trust object */
                     APPEND_LIST_ITEM(listItem);
                     listItem->io = AddObjectIfNeeded(CKO_NSS_TRUST, pemTrust,
-                                                    derlist[c], NULL, nickname, 0,
-                                                     slotID, NULL);
+                                                     derlist[c], NULL, nickname,
+                                                     slotID, PR_TRUE, NULL);
                 }
                 if (listItem->io == NULL)
                     goto loser;
             }
         } else {
             listItem->io = AddObjectIfNeeded(CKO_CERTIFICATE, pemCert,
-                                             derlist[0], NULL, filename, objid,
-                                             slotID, NULL);
+                                             derlist[0], NULL, filename,
+                                             slotID, PR_FALSE, NULL);
             if (listItem->io == NULL)
                 goto loser;
         }
@@ -1187,28 +1407,19 @@ pem_CreateObject
         SECItem certDER;
         PRBool added;
 
-        nobjs = ReadDERFromFile(&derlist, filename, &cipher, &ivstring,
-                                /* keys only */ PR_FALSE);
+        nobjs = pem_ReadTemplateDER(&derlist, &value, filename, &cipher,
+                                    &ivstring, /* keys only */ PR_FALSE);
         if (nobjs < 1)
             goto loser;
 
         certDER.len = 0; /* in case there is no equivalent cert */
         certDER.data = NULL;
 
-        /* Brute force: find the id of the certificate, if any, in this slot */
-        objid = -1;
-        list_for_each_entry_reverse(curObj, &pem_objs, gl_list) {
-            if (slotID != curObj->slotID)
-                continue;
-
-            if (curObj->type != pemCert)
-                continue;
-
-            if (curObj->objid != pem_nobjs)
-                /* not a certificate that refers to the key being added */
-                continue;
-
-            objid = pem_nobjs;
+        /* find the certificate the key being added belongs to, if any; this
+         * only matters if the key is encrypted, otherwise the two pair up by
+         * the public key anyway */
+        curObj = pem_FindUnpairedCert(slotID);
+        if (curObj) {
             certDER.data = NSS_ZAlloc(NULL, curObj->derCert->len);
 
             if (certDER.data == NULL)
@@ -1218,16 +1429,11 @@ pem_CreateObject
             memcpy(certDER.data,
                     curObj->derCert->data,
                     curObj->derCert->len);
-            break;
         }
 
-        /* We're just adding a key, we'll assume the cert is next */
-        if (objid == -1)
-            objid = pem_nobjs + 1;
-
         listItem->io =  AddObjectIfNeeded(CKO_PRIVATE_KEY, pemBareKey, &certDER,
-                                          derlist[0], filename, objid, slotID,
-                                          &added);
+                                          derlist[0], filename, slotID,
+                                          PR_FALSE, &added);
         if (listItem->io == NULL)
             goto loser;
 
@@ -1256,12 +1462,8 @@ pem_CreateObject
 
   loser:
 
-    for (i = 0; i < nobjs; i++) {
-        NSS_ZFreeIf(derlist[i]->data);
-        NSS_ZFreeIf(derlist[i]);
-    }
+    FreeDERList(derlist, nobjs);
     NSS_ZFreeIf(filename);
-    NSS_ZFreeIf(derlist);
     if ((pemInternalObject *) NULL == listItem->io) {
         pem_DestroyInternalObject(listObj);
         return (NSSCKMDObject *) NULL;
@@ -44,6 +44,7 @@
  * for the RSA operation.
  */
 
+#include <blapi.h>
 #include <nssckmdt.h>
 #include <secdert.h>
 #include <secoid.h>
@@ -170,7 +171,7 @@ pem_DestroyPrivateKey(NSSLOWKEYPrivateKey * privk)
 
 /* decode and parse the rawkey into the lpk structure */
 static NSSLOWKEYPrivateKey *
-pem_getPrivateKey(PLArenaPool *arena, SECItem *rawkey, CK_RV * pError, NSSItem *modulus)
+pem_getPrivateKey(PLArenaPool *arena, SECItem *rawkey, CK_RV * pError)
 {
     NSSLOWKEYPrivateKey *lpk = NULL;
     SECStatus rv = SECFailure;
@@ -214,23 +215,6 @@ pem_getPrivateKey(PLArenaPool *arena, SECItem *rawkey, CK_RV * pError, NSSItem *
     lpk->keyType = NSSLOWKEYRSAKey;
     prepare_low_rsa_priv_key_for_asn1(lpk);
 
-    /* I don't know what this is supposed to accomplish.  We free the old
-       modulus data and set it again, making a copy of the new data.
-       But we just allocated a new empty key structure above with
-       NSS_ZAlloc.  So lpk->u.rsa.modulus.data is NULL and
-       lpk->u.rsa.modulus.len.  If the intention is to free the old
-       modulus data, why not just set it to NULL after freeing?  Why
-       go through this unnecessary and confusing copying code?
-    */
-    if (modulus) {
-        NSS_ZFreeIf(modulus->data);
-        modulus->data = (void *) NSS_ZAlloc(NULL, lpk->u.rsa.modulus.len);
-        modulus->size = lpk->u.rsa.modulus.len;
-        memcpy(modulus->data,
-                lpk->u.rsa.modulus.data,
-                lpk->u.rsa.modulus.len);
-    }
-
     /* decode the private key and any algorithm parameters */
     rv = SEC_QuickDERDecodeItem(arena, lpk, pem_RSAPrivateKeyTemplate,
                                 keysrc);
@@ -247,6 +231,85 @@ done:
     return lpk;
 }
 
+/* make item point to the data of a decoded key component (no copy) */
+static void
+pem_ViewKeyComponent(NSSItem *item, const SECItem *component)
+{
+    item->data = component->data;
+    item->size = component->len;
+}
+
+SECStatus
+pem_FingerprintKey(pemKeyParams *kp, const SECItem *keyDER)
+{
+    kp->fingerprintLen = keyDER->len;
+    return SHA1_HashBuf(kp->fingerprint, keyDER->data, keyDER->len);
+}
+
+/*
+ * Keep a copy of the modulus and public exponent of the key (found in the key
+ * or in the certificate that comes with it on load) so that the public key
+ * attributes can be served without decoding, or even decrypting, privateKey.
+ */
+CK_RV
+pem_SetPublicKey(pemKeyParams *kp, const SECItem *modulus,
+                 const SECItem *exponent)
+{
+    unsigned char *buf = NSS_ZAlloc(NULL, modulus->len + exponent->len);
+
+    if (buf == NULL)
+        return CKR_HOST_MEMORY;
+
+    memcpy(buf, modulus->data, modulus->len);
+    memcpy(buf + modulus->len, exponent->data, exponent->len);
+
+    NSS_ZFreeIf(kp->pubKey);
+    kp->pubKey = buf;
+    kp->modulus.data = buf;
+    kp->modulus.size = modulus->len;
+    kp->exponent.data = buf + modulus->len;
+    kp->exponent.size = exponent->len;
+    return CKR_OK;
+}
+
+void
+pem_ForgetKeyComponents(pemKeyParams *kp)
+{
+    /* the arena is zeroed when freed, see pem_DestroyPrivateKey() */
+    pem_DestroyPrivateKey(kp->lpk);
+    kp->lpk = NULL;
+
+    if (!kp->pubKey) {
+        /* modulus and exponent point into the decoded key */
+        memset(&kp->modulus, 0, sizeof kp->modulus);
+        memset(&kp->exponent, 0, sizeof kp->exponent);
+    }
+    memset(&kp->privateExponent, 0, sizeof kp->privateExponent);
+    memset(&kp->prime1, 0, sizeof kp->prime1);
+    memset(&kp->prime2, 0, sizeof kp->prime2);
+    memset(&kp->exponent1, 0, sizeof kp->exponent1);
+    memset(&kp->exponent2, 0, sizeof kp->exponent2);
+    memset(&kp->coefficient, 0, sizeof kp->coefficient);
+}
+
+void
+pem_DestroyKeyParams(pemKeyParams *kp)
+{
+    pem_ForgetKeyComponents(kp);
+
+    /* NSS_ZFreeIf() wipes the memory before releasing it */
+    if (kp->privateKey) {
+        NSS_ZFreeIf(kp->privateKey->data);
+        NSS_ZFreeIf(kp->privateKey);
+        kp->privateKey = NULL;
+    }
+
+    NSS_ZFreeIf(kp->pubKey);
+    kp->pubKey = NULL;
+    memset(&kp->modulus, 0, sizeof kp->modulus);
+    memset(&kp->exponent, 0, sizeof kp->exponent);
+}
+
 CK_RV
 pem_PopulateModulusExponent(pemInternalObject * io)
 {
@@ -255,6 +318,7 @@ pem_PopulateModulusExponent(pemInternalObject * io)
     const NSSItem *keyType;
     NSSLOWKEYPrivateKey *lpk = NULL;
     PLArenaPool *arena;
+    pemKeyParams *kp = &io->u.key.key;
 
     classItem = pem_FetchAttribute(io, CKA_CLASS, &error);
     if (error != CKR_OK)
@@ -274,83 +338,34 @@ pem_PopulateModulusExponent(pemInternalObject * io)
         return CKR_KEY_TYPE_INCONSISTENT;
     }
 
+    if (kp->lpk)
+        /* already decoded */
+        return CKR_OK;
+
     arena = PORT_NewArena(2048);
     if (!arena) {
         return CKR_HOST_MEMORY;
     }
 
-    lpk = pem_getPrivateKey(arena, io->u.key.key.privateKey, &error, NULL);
+    lpk = pem_getPrivateKey(arena, kp->privateKey, &error);
     if (lpk == NULL) {
         plog("pem_PopulateModulusExponent: pem_getPrivateKey returned NULL, error 0x%08x\n", error);
-        PORT_FreeArena(arena, PR_FALSE);
+        PORT_FreeArena(arena, PR_TRUE);
         return (error ? error : CKR_KEY_TYPE_INCONSISTENT);
     }
 
-    NSS_ZFreeIf(io->u.key.key.modulus.data);
-    io->u.key.key.modulus.data =
-        (void *) NSS_ZAlloc(NULL, lpk->u.rsa.modulus.len);
-    io->u.key.key.modulus.size = lpk->u.rsa.modulus.len;
-    memcpy(io->u.key.key.modulus.data,
-            lpk->u.rsa.modulus.data,
-            lpk->u.rsa.modulus.len);
-
-    NSS_ZFreeIf(io->u.key.key.exponent.data);
-    io->u.key.key.exponent.data =
-        (void *) NSS_ZAlloc(NULL, lpk->u.rsa.publicExponent.len);
-    io->u.key.key.exponent.size = lpk->u.rsa.publicExponent.len;
-    memcpy(io->u.key.key.exponent.data,
-            lpk->u.rsa.publicExponent.data,
-            lpk->u.rsa.publicExponent.len);
-
-    NSS_ZFreeIf(io->u.key.key.privateExponent.data);
-    io->u.key.key.privateExponent.data =
-        (void *) NSS_ZAlloc(NULL, lpk->u.rsa.privateExponent.len);
-    io->u.key.key.privateExponent.size = lpk->u.rsa.privateExponent.len;
-    memcpy(io->u.key.key.privateExponent.data,
-            lpk->u.rsa.privateExponent.data,
-            lpk->u.rsa.privateExponent.len);
-
-    NSS_ZFreeIf(io->u.key.key.prime1.data);
-    io->u.key.key.prime1.data =
-        (void *) NSS_ZAlloc(NULL, lpk->u.rsa.prime1.len);
-    io->u.key.key.prime1.size = lpk->u.rsa.prime1.len;
-    memcpy(io->u.key.key.prime1.data,
-            lpk->u.rsa.prime1.data,
-            lpk->u.rsa.prime1.len);
-
-    NSS_ZFreeIf(io->u.key.key.prime2.data);
-    io->u.key.key.prime2.data =
-        (void *) NSS_ZAlloc(NULL, lpk->u.rsa.prime2.len);
-    io->u.key.key.prime2.size = lpk->u.rsa.prime2.len;
-    memcpy(io->u.key.key.prime2.data,
-            lpk->u.rsa.prime2.data,
-            lpk->u.rsa.prime2.len);
-
-    NSS_ZFreeIf(io->u.key.key.exponent1.data);
-    io->u.key.key.exponent1.data =
-        (void *) NSS_ZAlloc(NULL, lpk->u.rsa.exponent1.len);
-    io->u.key.key.exponent1.size = lpk->u.rsa.exponent1.len;
-    memcpy(io->u.key.key.exponent1.data,
-            lpk->u.rsa.exponent1.data,
-            lpk->u.rsa.exponent1.len);
-
-    NSS_ZFreeIf(io->u.key.key.exponent2.data);
-    io->u.key.key.exponent2.data =
-        (void *) NSS_ZAlloc(NULL, lpk->u.rsa.exponent2.len);
-    io->u.key.key.exponent2.size = lpk->u.rsa.exponent2.len;
-    memcpy(io->u.key.key.exponent2.data,
-            lpk->u.rsa.exponent2.data,
-            lpk->u.rsa.exponent2.len);
-
-    NSS_ZFreeIf(io->u.key.key.coefficient.data);
-    io->u.key.key.coefficient.data =
-        (void *) NSS_ZAlloc(NULL, lpk->u.rsa.coefficient.len);
-    io->u.key.key.coefficient.size = lpk->u.rsa.coefficient.len;
-    memcpy(io->u.key.key.coefficient.data,
-            lpk->u.rsa.coefficient.data,
-            lpk->u.rsa.coefficient.len);
-
-    pem_DestroyPrivateKey(lpk);
+    /* keep the decoded key, the items below point into its arena */
+    kp->lpk = lpk;
+    if (!kp->pubKey) {
+        pem_ViewKeyComponent(&kp->modulus, &lpk->u.rsa.modulus);
+        pem_ViewKeyComponent(&kp->exponent, &lpk->u.rsa.publicExponent);
+    }
+    pem_ViewKeyComponent(&kp->privateExponent, &lpk->u.rsa.privateExponent);
+    pem_ViewKeyComponent(&kp->prime1, &lpk->u.rsa.prime1);
+    pem_ViewKeyComponent(&kp->prime2, &lpk->u.rsa.prime2);
+    pem_ViewKeyComponent(&kp->exponent1, &lpk->u.rsa.exponent1);
+    pem_ViewKeyComponent(&kp->exponent2, &lpk->u.rsa.exponent2);
+    pem_ViewKeyComponent(&kp->coefficient, &lpk->u.rsa.coefficient);
     return CKR_OK;
 }
 
@@ -409,10 +424,11 @@ pem_mdCryptoOperationRSAPriv_Create
         return (NSSCKMDCryptoOperation *) NULL;
     }
 
-    lpk = pem_getPrivateKey(arena, iKey->u.key.key.privateKey, pError, &iKey->u.key.key.modulus);
+    lpk = pem_getPrivateKey(arena, iKey->u.key.key.privateKey, pError);
+    pem_Trace(PEM_TRACE_CRYPTO, pemTraceCryptoInit, iKey->arrayIdx, *pError);
     if (lpk == NULL) {
         plog("pem_mdCryptoOperationRSAPriv_Create: pem_getPrivateKey returned NULL, pError 0x%08x\n", *pError);
-        PORT_FreeArena(arena, PR_FALSE);
+        PORT_FreeArena(arena, PR_TRUE);
         return (NSSCKMDCryptoOperation *) NULL;
     }
 
@@ -586,6 +602,7 @@ pem_mdCryptoOperationRSASign_UpdateFinal
         (pemInternalCryptoOperationRSAPriv *) mdOperation->etc;
     CK_RV error = CKR_OK;
     SECStatus rv = SECSuccess;
+    PRIntervalTime start = PR_IntervalNow();
 
     rv = pem_RSA_Sign(iOperation->lpk, output->data, &output->size,
                       output->size, input->data, input->size);
@@ -594,6 +611,7 @@ pem_mdCryptoOperationRSASign_UpdateFinal
         error = CKR_GENERAL_ERROR;
     }
 
+    pem_StatsRecord(pemStatSign, start);
     return error;
 }
 
@@ -724,8 +742,14 @@ pem_mdMechanismRSA_SignInit
     CK_RV * pError
 )
 {
-    return pem_mdCryptoOperationRSAPriv_Create
+    NSSCKMDCryptoOperation *op;
+    PRIntervalTime start = PR_IntervalNow();
+
+    op = pem_mdCryptoOperationRSAPriv_Create
         (&pem_mdCryptoOperationRSASign_proto, mdMechanism, mdKey, pError);
+
+    pem_StatsRecord(pemStatSignInit, start);
+    return op;
 }
 
 NSS_IMPLEMENT_DATA const NSSCKMDMechanism
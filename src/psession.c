@@ -144,8 +144,8 @@ pem_mdSession_FindObjectsInit
 )
 {
     plog("mdSession_FindObjectsInit\n");
-    return pem_FindObjectsInit(fwSession, pTemplate, ulAttributeCount,
-                               pError);
+    return pem_FindObjectsInit(mdSession, fwSession, pTemplate,
+                               ulAttributeCount, pError);
 }
 
 static NSSCKMDObject *
@@ -241,7 +241,9 @@ pem_mdSession_Login
     NSSLOWKEYPrivateKey *lpk = NULL;
     PLArenaPool *arena;
     SECItem plain;
-    pemInternalObject *curObj;
+    pemSlotStore *store;
+    long i;
+    PRIntervalTime start = PR_IntervalNow();
 
     fwSlot = NSSCKFWToken_GetFWSlot(fwToken);
     slotID = NSSCKFWSlot_GetSlotID(fwSlot);
@@ -256,9 +258,10 @@ pem_mdSession_Login
     token_needsLogin[slotID - 1] = PR_FALSE;
 
     /* Find the right key object */
-    list_for_each_entry(curObj, &pem_objs, gl_list) {
-        if ((slotID == curObj->slotID) && (curObj->type == pemBareKey)) {
-            io = curObj;
+    store = pem_GetSlotStore(slotID, PR_FALSE);
+    for (i = 0; store && i < store->nentries; i++) {
+        if (store->objs[i].io && store->objs[i].type == pemBareKey) {
+            io = store->objs[i].io;
             break;
         }
     }
@@ -331,6 +334,9 @@ pem_mdSession_Login
     if (rv != SECSuccess)
         goto loser;
 
+    /* the decoded components (if any) belong to the encrypted key */
+    pem_ForgetKeyComponents(&io->u.key.key);
+
     NSS_ZFreeIf(io->u.key.key.privateKey->data);
     io->u.key.key.privateKey->len = len - output[len - 1];
     io->u.key.key.privateKey->data =
@@ -341,13 +347,30 @@ pem_mdSession_Login
 
   loser:
     if (arena)
-        PORT_FreeArena(arena, PR_FALSE);
+        PORT_FreeArena(arena, PR_TRUE);
     NSS_ZFreeIf(iv);
     NSS_ZFreeIf(output);
+    pem_Trace(PEM_TRACE_SESSION, pemTraceLogin, slotID, rv);
+    pem_StatsRecord(pemStatLogin, start);
 
     return rv;
 }
 
+static void
+pem_mdSession_Close
+(
+    NSSCKMDSession * mdSession,
+    NSSCKFWSession * fwSession,
+    NSSCKMDToken * mdToken,
+    NSSCKFWToken * fwToken,
+    NSSCKMDInstance * mdInstance,
+    NSSCKFWInstance * fwInstance
+)
+{
+    /* the session itself lives in the arena of fwSession */
+    pem_DestroyFindObjectsCache((pemSession *) mdSession->etc);
+}
+
 NSS_IMPLEMENT NSSCKMDSession *
 pem_CreateSession
 (
@@ -357,6 +380,7 @@ pem_CreateSession
 {
     NSSArena *arena;
     NSSCKMDSession *rv;
+    pemSession *session;
 
     plog("pem_CreateSession returning new session\n");
     arena = NSSCKFWSession_GetArena(fwSession, pError);
@@ -370,13 +394,20 @@ pem_CreateSession
         return (NSSCKMDSession *) NULL;
     }
 
+    session = NSS_ZNEW(arena, pemSession);
+    if ((pemSession *) NULL == session) {
+        *pError = CKR_HOST_MEMORY;
+        return (NSSCKMDSession *) NULL;
+    }
+    session->fwSession = fwSession;
+
     /*
      * rv was zeroed when allocated, so we only
      * need to set the non-zero members.
      */
 
-    rv->etc = (void *) fwSession;
-    /* rv->Close */
+    rv->etc = (void *) session;
+    rv->Close = pem_mdSession_Close;
     /* rv->GetDeviceError */
     rv->Login = pem_mdSession_Login;
     /* rv->Logout */
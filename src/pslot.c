@@ -54,17 +54,9 @@ pem_mdSlot_GetSlotDescription
     CK_RV * pError
 )
 {
-    CK_SLOT_ID slotID;
-    NSSArena *arena;
-    char *slotid;
-
-    arena = NSSCKFWInstance_GetArena(fwInstance, pError);
-    slotID = NSSCKFWSlot_GetSlotID(fwSlot);
+    pemToken *token = (pemToken *) ((NSSCKMDToken *) mdSlot->etc)->etc;
 
-    slotid = (char *) NSS_ZAlloc(arena, 256);
-    snprintf(slotid, 256, "PEM Slot #%ld", slotID);
-
-    return (NSSUTF8 *) slotid;
+    return (NSSUTF8 *) token->slotDescription;
 }
 
 static NSSUTF8 *
@@ -133,6 +125,7 @@ NSSCKMDSlot *
 pem_NewSlot
 (
     NSSCKFWInstance * fwInstance,
+    CK_SLOT_ID slotID,
     CK_RV * pError
 )
 {
@@ -153,7 +146,10 @@ pem_NewSlot
         return (NSSCKMDSlot *) NULL;
     }
 
-    mdSlot->etc = pem_NewToken(fwInstance, pError);
+    mdSlot->etc = pem_NewToken(fwInstance, slotID, pError);
+    if ((NSSCKMDToken *) NULL == mdSlot->etc) {
+        return (NSSCKMDSlot *) NULL;
+    }
 
     mdSlot->GetSlotDescription = pem_mdSlot_GetSlotDescription;
     mdSlot->GetManufacturerID = pem_mdSlot_GetManufacturerID;
@@ -0,0 +1,479 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Netscape security libraries.
+ *
+ * The Initial Developer of the Original Code is
+ * Netscape Communications Corporation.
+ * Portions created by the Initial Developer are Copyright (C) 1994-2000
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Rob Crittenden (rcritten@redhat.com)
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include "ckpem.h"
+
+#include <blapi.h>
+#include <nspr.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * psnap.c
+ *
+ * This file implements an optional on-disk cache of certificates decoded
+ * from PEM files.  If NSS_PEM_SNAPSHOT_DIR is set in the environment, the
+ * DER encoded certificates read from each file are saved to a snapshot in
+ * that directory and subsequent reads of the same unchanged file map the
+ * snapshot instead of decoding the file again.
+ *
+ * A snapshot is identified by the SHA-1 hash of the path of its source file
+ * and is only used if the source file still has the recorded path, size,
+ * modification time and SHA-256 digest of its contents.  The digest costs a
+ * read of the source, but no decoding or allocation, and catches rewrites
+ * that keep the size and the modification time.  Private keys are never
+ * written to a snapshot.
+ *
+ * The certificates of a snapshot become trust anchors, so snapshots are
+ * created with mode 0600 through mkstemp() and only loaded if they are
+ * regular files owned by the effective user and not writable by anybody
+ * else.
+ *
+ * A snapshot that is used stays mapped (shared, read-only) until C_Finalize
+ * and the certificates loaded from it borrow their DER encoding from the
+ * mapping instead of copying it.  The worker processes of a pre-forked
+ * server pointed to the same directory thus share a single copy of the
+ * certificates in the page cache; only the object structures themselves
+ * (reference counts, parsed fields, login state) are private.  Snapshots
+ * are only ever replaced by rename(), so a mapping in use never changes.
+ *
+ * Layout of a snapshot (native byte order, all offsets are relative to the
+ * beginning of the file so that it can be used directly once mapped):
+ *
+ *   pemSnapHeader
+ *   path of the source file (pathLen bytes, padded to 8 bytes)
+ *   pemSnapEntry[count]
+ *   DER encoded certificates
+ */
+
+#define PEM_SNAP_MAGIC "NSSPEMS"
+#define PEM_SNAP_VERSION 2
+#define PEM_SNAP_ALIGN(n) (((n) + 7) & ~((PRUint32) 7))
+
+typedef struct pemSnapHeaderStr {
+    char        magic[8];
+    PRUint32    version;
+    PRUint32    count;
+    PRInt64     srcSize;
+    PRTime      srcMtime;
+    PRUint32    pathLen;
+    PRUint32    reserved;
+    unsigned char srcDigest[SHA256_LENGTH];
+} pemSnapHeader;
+
+typedef struct pemSnapEntryStr {
+    PRUint32    offset;
+    PRUint32    len;
+} pemSnapEntry;
+
+/* a snapshot mapped and validated by pem_SnapshotLoad() */
+typedef struct pemSnapMapStr {
+    unsigned char *map;
+    PRUint32    size;
+    char        *filename;      /* of the source */
+    PRInt64     srcSize;        /* of the source as validated */
+    PRTime      srcMtime;
+    struct pemSnapMapStr *next;
+} pemSnapMap;
+
+static pemSnapMap *pem_snapMaps = NULL;
+
+static const char *
+pem_SnapshotDir(void)
+{
+    const char *dir = PR_GetEnv("NSS_PEM_SNAPSHOT_DIR");
+    return (dir && *dir) ? dir : NULL;
+}
+
+/* whether certificates may be loaded from snapshots at all */
+PRBool
+pem_SnapshotEnabled(void)
+{
+    return pem_SnapshotDir() != NULL;
+}
+
+/* construct path of the snapshot of the given source file */
+static char *
+pem_SnapshotPath(const char *dir, const char *filename)
+{
+    unsigned char hash[SHA1_LENGTH];
+    char hex[2 * SHA1_LENGTH + 1];
+    int i;
+
+    if (SECSuccess != SHA1_HashBuf(hash, (const unsigned char *) filename,
+                                   strlen(filename)))
+        return NULL;
+
+    for (i = 0; i < SHA1_LENGTH; i++)
+        sprintf(hex + 2 * i, "%02x", hash[i]);
+
+    return PR_smprintf("%s/%s.snap", dir, hex);
+}
+
+/*
+ * Check the mapped snapshot against the source file, except for the digest
+ * of its contents, which costs a read of the source and is compared last by
+ * pem_SnapshotLoad().  Returns the header or NULL.
+ */
+static const pemSnapHeader *
+pem_SnapshotCheck(const unsigned char *map, PRUint32 size,
+                  const char *filename, const PRFileInfo64 *srcInfo)
+{
+    const pemSnapHeader *hdr = (const pemSnapHeader *) map;
+    const pemSnapEntry *entries;
+    PRUint32 pathLen = strlen(filename);
+    PRUint32 off;
+    PRUint32 i;
+
+    if (size < sizeof *hdr
+            || memcmp(hdr->magic, PEM_SNAP_MAGIC, sizeof hdr->magic)
+            || hdr->version != PEM_SNAP_VERSION
+            || hdr->srcSize != srcInfo->size
+            || hdr->srcMtime != srcInfo->modifyTime
+            || hdr->pathLen != pathLen
+            || hdr->count == 0)
+        return NULL;
+
+    off = sizeof *hdr;
+    if (size - off < PEM_SNAP_ALIGN(pathLen)
+            || memcmp(map + off, filename, pathLen))
+        return NULL;
+
+    off += PEM_SNAP_ALIGN(pathLen);
+    if ((size - off) / sizeof *entries < hdr->count)
+        return NULL;
+
+    entries = (const pemSnapEntry *) (map + off);
+    for (i = 0; i < hdr->count; i++) {
+        if (entries[i].offset > size
+                || entries[i].len > size - entries[i].offset)
+            return NULL;
+    }
+    return hdr;
+}
+
+/* list the certificates of a checked snapshot, the items point into the
+ * mapping */
+static int
+pem_SnapshotList(SECItem ***derlist, const unsigned char *map)
+{
+    const pemSnapHeader *hdr = (const pemSnapHeader *) map;
+    const pemSnapEntry *entries;
+    SECItem **list;
+    PRUint32 i;
+
+    entries = (const pemSnapEntry *) (map + sizeof *hdr
+                                      + PEM_SNAP_ALIGN(hdr->pathLen));
+
+    list = NSS_ZNEWARRAY(NULL, SECItem *, hdr->count);
+    if (!list)
+        return -1;
+
+    for (i = 0; i < hdr->count; i++) {
+        list[i] = NSS_ZNEW(NULL, SECItem);
+        if (!list[i])
+            goto loser;
+        list[i]->data = (unsigned char *) map + entries[i].offset;
+        list[i]->len = entries[i].len;
+    }
+
+    *derlist = list;
+    return hdr->count;
+
+loser:
+    for (i = 0; i < hdr->count && list[i]; i++)
+        NSS_ZFreeIf(list[i]);
+    NSS_ZFreeIf(list);
+    return -1;
+}
+
+/* compute the SHA-256 digest of the contents of the file */
+static SECStatus
+pem_SnapshotDigest(const char *filename, unsigned char *digest)
+{
+    struct stat st;
+    void *map;
+    SECStatus rv;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return SECFailure;
+    if (fstat(fd, &st) || st.st_size <= 0 || st.st_size > PR_INT32_MAX) {
+        close(fd);
+        return SECFailure;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map)
+        return SECFailure;
+
+    rv = SHA256_HashBuf(digest, map, (PRUint32) st.st_size);
+    munmap(map, st.st_size);
+    return rv;
+}
+
+/*
+ * Returns count of certificates read from the snapshot, or -1 on miss.  The
+ * certificates point into the snapshot, which stays mapped until
+ * pem_SnapshotRelease(); free the list with FreeDERList().  A source file
+ * configured more than once (e.g. in several slots) is only validated the
+ * first time, as long as its size and modification time stay the same.  If
+ * the source had to be hashed for a miss, src is set to its digest so that
+ * the caller need not hash it again to store a new snapshot.
+ */
+int
+pem_SnapshotLoad(SECItem ***derlist, const char *filename, pemSrcDigest *src)
+{
+    const char *dir = pem_SnapshotDir();
+    const pemSnapHeader *hdr;
+    PRFileInfo64 srcInfo;
+    struct stat st;
+    void *map = MAP_FAILED;
+    pemSnapMap *sm;
+    char *path;
+    int count = -1;
+    int fd;
+
+    src->valid = PR_FALSE;
+    if (!dir)
+        return -1;
+
+    if (PR_SUCCESS != PR_GetFileInfo64(filename, &srcInfo))
+        return -1;
+
+    for (sm = pem_snapMaps; sm; sm = sm->next) {
+        if (strcmp(sm->filename, filename))
+            continue;
+        if (sm->srcSize != srcInfo.size || sm->srcMtime != srcInfo.modifyTime)
+            /* changed since, decode it */
+            return -1;
+        return pem_SnapshotList(derlist, sm->map);
+    }
+
+    path = pem_SnapshotPath(dir, filename);
+    if (!path)
+        return -1;
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+        goto done;
+
+    /* anybody who can write the snapshot can plant trust anchors */
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != geteuid()
+            || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        plog("pem_SnapshotLoad: ignoring unsafe snapshot %s\n", path);
+        goto done;
+    }
+    if (st.st_size < (off_t) sizeof(pemSnapHeader)
+            || st.st_size > PR_INT32_MAX)
+        goto done;
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == map)
+        goto done;
+
+    hdr = pem_SnapshotCheck(map, (PRUint32) st.st_size, filename, &srcInfo);
+    if (hdr && SECSuccess == pem_SnapshotDigest(filename, src->digest)) {
+        src->info = srcInfo;
+        src->valid = PR_TRUE;
+    }
+    if (!src->valid
+            || memcmp(hdr->srcDigest, src->digest, sizeof hdr->srcDigest)) {
+        plog("pem_SnapshotLoad: %s: stale snapshot %s\n", filename, path);
+        goto done;
+    }
+
+    sm = NSS_ZNEW(NULL, pemSnapMap);
+    if (!sm)
+        goto done;
+    sm->filename = NSS_ZAlloc(NULL, strlen(filename) + 1);
+    if (!sm->filename) {
+        NSS_ZFreeIf(sm);
+        goto done;
+    }
+
+    /* keep the mapping, the certificates are borrowed from it */
+    strcpy(sm->filename, filename);
+    sm->map = map;
+    sm->size = (PRUint32) st.st_size;
+    sm->srcSize = srcInfo.size;
+    sm->srcMtime = srcInfo.modifyTime;
+    sm->next = pem_snapMaps;
+    pem_snapMaps = sm;
+    map = MAP_FAILED;
+
+    count = pem_SnapshotList(derlist, sm->map);
+    plog("pem_SnapshotLoad: %s: %d certificates from %s\n", filename, count,
+         path);
+
+done:
+    if (MAP_FAILED != map)
+        munmap(map, st.st_size);
+    if (fd >= 0)
+        close(fd);
+    PR_smprintf_free(path);
+    return count;
+}
+
+/* tell whether data points into a snapshot mapped by pem_SnapshotLoad() */
+PRBool
+pem_SnapshotOwns(const void *data)
+{
+    const unsigned char *p = data;
+    const pemSnapMap *sm;
+
+    for (sm = pem_snapMaps; sm; sm = sm->next) {
+        if (sm->map <= p && p < sm->map + sm->size)
+            return PR_TRUE;
+    }
+    return PR_FALSE;
+}
+
+/* unmap all snapshots, nothing may point into them any more */
+void
+pem_SnapshotRelease(void)
+{
+    pemSnapMap *sm;
+
+    while ((sm = pem_snapMaps) != NULL) {
+        pem_snapMaps = sm->next;
+        munmap(sm->map, sm->size);
+        NSS_ZFreeIf(sm->filename);
+        NSS_ZFreeIf(sm);
+    }
+}
+
+static PRBool
+pem_SnapshotWrite(int fd, const void *buf, PRUint32 len)
+{
+    const unsigned char *p = buf;
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n <= 0)
+            return PR_FALSE;
+        p += n;
+        len -= n;
+    }
+    return PR_TRUE;
+}
+
+/* save certificates decoded from filename to a snapshot, errors are ignored;
+ * srcInfo describes the source file as it was before it was read and
+ * srcDigest is the SHA-256 digest of the contents that were decoded */
+void
+pem_SnapshotStore(SECItem **derlist, int count, const char *filename,
+                  const PRFileInfo64 *srcInfo, const unsigned char *srcDigest)
+{
+    static const unsigned char pad[8];
+    const char *dir = pem_SnapshotDir();
+    pemSnapHeader hdr;
+    pemSnapEntry entry;
+    char *path, *tmp;
+    PRUint32 off;
+    PRBool ok;
+    int fd;
+    int i;
+
+    if (!dir || count <= 0 || !srcDigest)
+        return;
+
+    path = pem_SnapshotPath(dir, filename);
+    if (!path)
+        return;
+
+    /* a fresh file of mode 0600 that nobody else can have prepared */
+    tmp = PR_smprintf("%s.XXXXXX", path);
+    if (!tmp) {
+        PR_smprintf_free(path);
+        return;
+    }
+
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        goto done;
+
+    memset(&hdr, 0, sizeof hdr);
+    memcpy(hdr.magic, PEM_SNAP_MAGIC, sizeof hdr.magic);
+    hdr.version = PEM_SNAP_VERSION;
+    hdr.count = count;
+    hdr.srcSize = srcInfo->size;
+    hdr.srcMtime = srcInfo->modifyTime;
+    hdr.pathLen = strlen(filename);
+    memcpy(hdr.srcDigest, srcDigest, sizeof hdr.srcDigest);
+
+    ok = pem_SnapshotWrite(fd, &hdr, sizeof hdr)
+        && pem_SnapshotWrite(fd, filename, hdr.pathLen)
+        && pem_SnapshotWrite(fd, pad, PEM_SNAP_ALIGN(hdr.pathLen)
+                                      - hdr.pathLen);
+
+    off = sizeof hdr + PEM_SNAP_ALIGN(hdr.pathLen) + count * sizeof entry;
+    for (i = 0; ok && i < count; i++) {
+        entry.offset = off;
+        entry.len = derlist[i]->len;
+        ok = pem_SnapshotWrite(fd, &entry, sizeof entry);
+        off += entry.len;
+    }
+
+    for (i = 0; ok && i < count; i++)
+        ok = pem_SnapshotWrite(fd, derlist[i]->data, derlist[i]->len);
+
+    if (close(fd))
+        ok = PR_FALSE;
+
+    /* atomically replace the previous snapshot, if any */
+    if (!ok || rename(tmp, path)) {
+        unlink(tmp);
+        goto done;
+    }
+
+    plog("pem_SnapshotStore: %s: %d certificates to %s\n", filename, count,
+         path);
+
+done:
+    PR_smprintf_free(tmp);
+    PR_smprintf_free(path);
+}
@@ -0,0 +1,287 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Netscape security libraries.
+ *
+ * The Initial Developer of the Original Code is
+ * Netscape Communications Corporation.
+ * Portions created by the Initial Developer are Copyright (C) 1994-2000
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Rob Crittenden (rcritten@redhat.com)
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include "ckpem.h"
+
+#include <nspr.h>
+
+/*
+ * pstats.c
+ *
+ * Per-operation counters and latency histograms of the "PEM objects"
+ * cryptoki module.
+ *
+ * Threads record into one of a fixed number of shards chosen by a hash of the
+ * thread, so that concurrent threads rarely contend for the lock of a shard.
+ * The shards are static and nothing is attached to the threads, so no code of
+ * the module runs after it has been unloaded.  The shards are merged when the
+ * statistics are read, either through the CKA_VALUE attribute of the
+ * CKO_PEM_STATS object available in each slot, or into the file given by
+ * NSS_PEM_STATS_FILE on C_Finalize.
+ *
+ * Latencies are kept in microseconds in log-linear buckets: values below 16
+ * have a bucket each, larger values are split into 8 buckets per power of
+ * two, which bounds the relative error of the reported quantiles by 1/8.
+ */
+
+#define PEM_STAT_LINEAR         16
+#define PEM_STAT_SUB_BITS       3
+#define PEM_STAT_SUB            (1 << PEM_STAT_SUB_BITS)
+#define PEM_STAT_BUCKETS        (PEM_STAT_LINEAR + (32 - 4) * PEM_STAT_SUB)
+#define PEM_STAT_SHARDS         8       /* must be a power of two */
+
+typedef struct pemStatsShardStr pemStatsShard;
+struct pemStatsShardStr {
+    PRUint64        count[pemStatCount];
+    PRUint64        total[pemStatCount];
+    PRUint64        max[pemStatCount];
+    PRUint64        buckets[pemStatCount][PEM_STAT_BUCKETS];
+};
+
+static const char *const pem_statNames[pemStatCount] = {
+    "Initialize",
+    "FindObjectsInit",
+    "GetAttribute",
+    "Login",
+    "SignInit",
+    "Sign",
+};
+
+static PRCallOnceType pem_statsOnce;
+
+/* each shard is guarded by the lock of the same index */
+static PRLock *pem_statsLocks[PEM_STAT_SHARDS];
+static pemStatsShard pem_statsShards[PEM_STAT_SHARDS];
+
+static void
+pem_StatsMerge(pemStatsShard *dst, const pemStatsShard *src)
+{
+    int op, b;
+
+    for (op = 0; op < pemStatCount; op++) {
+        dst->count[op] += src->count[op];
+        dst->total[op] += src->total[op];
+        if (dst->max[op] < src->max[op])
+            dst->max[op] = src->max[op];
+        for (b = 0; b < PEM_STAT_BUCKETS; b++)
+            dst->buckets[op][b] += src->buckets[op][b];
+    }
+}
+
+static PRStatus
+pem_StatsInitOnce(void)
+{
+    int i;
+
+    for (i = 0; i < PEM_STAT_SHARDS; i++) {
+        pem_statsLocks[i] = PR_NewLock();
+        if (!pem_statsLocks[i])
+            return PR_FAILURE;
+    }
+    return PR_SUCCESS;
+}
+
+/* index of the shard of the calling thread */
+static int
+pem_StatsShardIndex(void)
+{
+    PRUword thread = (PRUword) PR_GetCurrentThread();
+
+    /* thread structures are aligned, mix in the higher bits */
+    thread ^= thread >> 7;
+    thread ^= thread >> 13;
+    return (int) (thread & (PEM_STAT_SHARDS - 1));
+}
+
+static int
+pem_StatsBucket(PRUint64 us)
+{
+    int exp = 0;
+
+    if (us < PEM_STAT_LINEAR)
+        return (int) us;
+
+    if (us > PR_UINT32_MAX)
+        us = PR_UINT32_MAX;
+
+    while ((us >> exp) > 1)
+        exp++;
+
+    /* exp >= 4 here, take the PEM_STAT_SUB_BITS bits below the leading one */
+    return PEM_STAT_LINEAR + (exp - 4) * PEM_STAT_SUB
+        + (int) ((us >> (exp - PEM_STAT_SUB_BITS)) & (PEM_STAT_SUB - 1));
+}
+
+/* the largest value that falls into the given bucket */
+static PRUint64
+pem_StatsBucketValue(int bucket)
+{
+    int exp, sub;
+
+    if (bucket < PEM_STAT_LINEAR)
+        return bucket;
+
+    exp = 4 + (bucket - PEM_STAT_LINEAR) / PEM_STAT_SUB;
+    sub = (bucket - PEM_STAT_LINEAR) % PEM_STAT_SUB;
+    return ((PRUint64) (PEM_STAT_SUB + sub + 1) << (exp - PEM_STAT_SUB_BITS))
+        - 1;
+}
+
+/* record an operation started at start, as taken from PR_IntervalNow() */
+void
+pem_StatsRecord(pemStatOp op, PRIntervalTime start)
+{
+    PRUint64 us = PR_IntervalToMicroseconds(PR_IntervalNow() - start);
+    int bucket = pem_StatsBucket(us);
+    pemStatsShard *shard;
+    int i;
+
+    if (PR_SUCCESS != PR_CallOnce(&pem_statsOnce, pem_StatsInitOnce))
+        return;
+
+    i = pem_StatsShardIndex();
+    shard = &pem_statsShards[i];
+
+    PR_Lock(pem_statsLocks[i]);
+    shard->count[op]++;
+    shard->total[op] += us;
+    if (shard->max[op] < us)
+        shard->max[op] = us;
+    shard->buckets[op][bucket]++;
+    PR_Unlock(pem_statsLocks[i]);
+}
+
+static PRUint64
+pem_StatsQuantile(const pemStatsShard *sum, int op, int permille)
+{
+    PRUint64 rank = (sum->count[op] * permille + 999) / 1000;
+    PRUint64 seen = 0;
+    int b;
+
+    for (b = 0; b < PEM_STAT_BUCKETS; b++) {
+        seen += sum->buckets[op][b];
+        if (seen && seen >= rank) {
+            /* the bucket bound may overshoot the largest value recorded */
+            PRUint64 value = pem_StatsBucketValue(b);
+            return (value < sum->max[op]) ? value : sum->max[op];
+        }
+    }
+    return 0;
+}
+
+#define PEM_STAT_HEADER_FMT "%-16s %20s %20s %12s %12s %12s %12s %12s\n"
+#define PEM_STAT_LINE_FMT   "%-16s %20llu %20llu %12llu %12llu %12llu %12llu %12llu\n"
+#define PEM_STAT_LINE_LEN   (16 + 2 * 21 + 5 * 13 + 1)
+
+PRUint32
+pem_StatsReportSize(void)
+{
+    return (1 + pemStatCount) * PEM_STAT_LINE_LEN;
+}
+
+/*
+ * Format the merged statistics as a table with one line per operation into
+ * buf, which needs to hold pem_StatsReportSize() bytes plus a terminating
+ * zero.  All fields have a fixed width, so the size does not depend on the
+ * values.  Latencies are given in microseconds.
+ */
+void
+pem_StatsReport(char *buf)
+{
+    pemStatsShard *sum = PR_NEWZAP(pemStatsShard);
+    int op, i;
+
+    if (!sum) {
+        memset(buf, ' ', pem_StatsReportSize());
+        buf[pem_StatsReportSize()] = '\0';
+        return;
+    }
+
+    if (PR_SUCCESS == PR_CallOnce(&pem_statsOnce, pem_StatsInitOnce)) {
+        for (i = 0; i < PEM_STAT_SHARDS; i++) {
+            PR_Lock(pem_statsLocks[i]);
+            pem_StatsMerge(sum, &pem_statsShards[i]);
+            PR_Unlock(pem_statsLocks[i]);
+        }
+    }
+
+    buf += PR_snprintf(buf, PEM_STAT_LINE_LEN + 1, PEM_STAT_HEADER_FMT,
+                       "operation", "count", "total_us", "mean_us", "p50_us",
+                       "p90_us", "p99_us", "max_us");
+    for (op = 0; op < pemStatCount; op++) {
+        PRUint64 count = sum->count[op];
+
+        buf += PR_snprintf(buf, PEM_STAT_LINE_LEN + 1, PEM_STAT_LINE_FMT,
+                           pem_statNames[op], count, sum->total[op],
+                           count ? sum->total[op] / count : 0,
+                           pem_StatsQuantile(sum, op, 500),
+                           pem_StatsQuantile(sum, op, 900),
+                           pem_StatsQuantile(sum, op, 990),
+                           sum->max[op]);
+    }
+
+    PR_Free(sum);
+}
+
+/* dump the statistics into NSS_PEM_STATS_FILE if set and start over */
+void
+pem_StatsFinalize(void)
+{
+    const char *file = PR_GetEnv("NSS_PEM_STATS_FILE");
+    PRFileDesc *fd;
+    char *buf;
+    int i;
+
+    if (file && (buf = PR_Malloc(pem_StatsReportSize() + 1))) {
+        pem_StatsReport(buf);
+        fd = PR_Open(file, PR_WRONLY | PR_CREATE_FILE | PR_APPEND, 0644);
+        if (fd) {
+            PR_Write(fd, buf, strlen(buf));
+            PR_Close(fd);
+        }
+        PR_Free(buf);
+    }
+
+    if (PR_SUCCESS != PR_CallOnce(&pem_statsOnce, pem_StatsInitOnce))
+        return;
+
+    for (i = 0; i < PEM_STAT_SHARDS; i++) {
+        PR_Lock(pem_statsLocks[i]);
+        memset(&pem_statsShards[i], 0, sizeof pem_statsShards[i]);
+        PR_Unlock(pem_statsLocks[i]);
+    }
+}
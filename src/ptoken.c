@@ -54,19 +54,9 @@ pem_mdToken_GetLabel
     CK_RV * pError
 )
 {
-    NSSCKFWSlot *fwSlot;
-    CK_SLOT_ID slotID;
-    NSSArena *arena;
-    char *tokenid;
-
-    arena = NSSCKFWInstance_GetArena(fwInstance, pError);
-    fwSlot = NSSCKFWToken_GetFWSlot(fwToken);
-    slotID = NSSCKFWSlot_GetSlotID(fwSlot);
-
-    tokenid = (char *) NSS_ZAlloc(arena, 256);
-    snprintf(tokenid, 256, "PEM Token #%ld", slotID);
+    pemToken *token = (pemToken *) mdToken->etc;
 
-    return (NSSUTF8 *) tokenid;
+    return (NSSUTF8 *) token->label;
 }
 
 static NSSUTF8 *
@@ -225,18 +215,14 @@ pem_mdToken_GetLoginRequired
     NSSCKFWInstance * fwInstance
 )
 {
-    char *label;
-    CK_RV pError;
+    pemToken *token = (pemToken *) mdToken->etc;
     NSSCKFWSlot *fwSlot;
     CK_SLOT_ID slotID;
 
     fwSlot = NSSCKFWToken_GetFWSlot(fwToken);
     slotID = NSSCKFWSlot_GetSlotID(fwSlot);
 
-    label = pem_mdToken_GetLabel(mdToken, fwToken, mdInstance, fwInstance,
-                             &pError);
-
-    plog("pem_mdToken_GetLoginRequired %s: %d\n", label,
+    plog("pem_mdToken_GetLoginRequired %s: %d\n", token->label,
          token_needsLogin[slotID - 1]);
 
     if (token_needsLogin[slotID - 1] == PR_TRUE)
@@ -249,6 +235,7 @@ NSSCKMDToken *
 pem_NewToken
 (
     NSSCKFWInstance * fwInstance,
+    CK_SLOT_ID slotID,
     CK_RV * pError
 )
 {
@@ -275,6 +262,11 @@ pem_NewToken
         return (NSSCKMDToken *) NULL;
     }
 
+    /* the descriptions never change, format them only once */
+    snprintf(token->label, sizeof token->label, "PEM Token #%ld", slotID);
+    snprintf(token->slotDescription, sizeof token->slotDescription,
+             "PEM Slot #%ld", slotID);
+
     mdToken->etc = (void *) token;
     mdToken->GetLabel = pem_mdToken_GetLabel;
     mdToken->GetManufacturerID = pem_mdToken_GetManufacturerID;
@@ -0,0 +1,298 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0/LGPL 2.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Netscape security libraries.
+ *
+ * The Initial Developer of the Original Code is
+ * Netscape Communications Corporation.
+ * Portions created by the Initial Developer are Copyright (C) 1994-2000
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Rob Crittenden (rcritten@redhat.com)
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either the GNU General Public License Version 2 or later (the "GPL"), or
+ * the GNU Lesser General Public License Version 2.1 or later (the "LGPL"),
+ * in which case the provisions of the GPL or the LGPL are applicable instead
+ * of those above. If you wish to allow use of your version of this file only
+ * under the terms of either the GPL or the LGPL, and not to allow others to
+ * use your version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL or the LGPL. If you do not delete
+ * the provisions above, a recipient may use your version of this file under
+ * the terms of any one of the MPL, the GPL or the LGPL.
+ *
+ * ***** END LICENSE BLOCK ***** */
+
+#include "ckpem.h"
+
+#include <nspr.h>
+
+#include <stdarg.h>
+
+/*
+ * ptrace.c
+ *
+ * Runtime tracing of the "PEM objects" cryptoki module.
+ *
+ * Tracing is always compiled in but costs only a test of pem_traceMask at
+ * each trace point unless it is enabled.  The categories to trace are given
+ * as a comma-separated list in the trace= module parameter or, if there is
+ * none, in the NSS_PEM_TRACE environment variable, e.g. trace=init,find.  A
+ * category also enables its sub-categories, so "find" traces both "find" and
+ * "find.match".
+ *
+ * Events are recorded in binary form into a ring buffer, no formatting takes
+ * place on the hot path.  The ring can be read as text at any time from the
+ * CKA_PEM_TRACE attribute of the statistics object, and it is dumped into the
+ * trace file on C_Finalize.  Formatted plog() messages are traced by the
+ * "log" category, which is enabled by default in DEBUG builds.  The trace
+ * file is given by the tracefile= module parameter, NSS_PEM_TRACE_FILE or
+ * NSPR_LOG_FILE; without one, nothing is written and plog() is disabled.
+ * The module writes the file through its own descriptor, the NSPR log of the
+ * process is left alone.
+ */
+
+#define LOGGING_BUFFER_SIZE 400
+#define PEM_TRACE_RING_SIZE 4096        /* must be a power of two */
+#define PEM_TRACE_LINE_LEN 96           /* bound of a formatted record */
+
+static const struct {
+    const char *name;
+    PRUint32 mask;
+} pem_traceCategories[] = {
+    { "all",            ~(PRUint32) 0 },
+    { "log",            PEM_TRACE_LOG },
+    { "init",           PEM_TRACE_INIT },
+    { "io",             PEM_TRACE_IO },
+    { "object",         PEM_TRACE_OBJECT | PEM_TRACE_ATTR },
+    { "object.attr",    PEM_TRACE_ATTR },
+    { "find",           PEM_TRACE_FIND | PEM_TRACE_MATCH },
+    { "find.match",     PEM_TRACE_MATCH },
+    { "session",        PEM_TRACE_SESSION | PEM_TRACE_CRYPTO },
+    { "session.crypto", PEM_TRACE_CRYPTO },
+};
+
+/* names of pemTraceEvent values, in the same order */
+static const char *const pem_traceEventNames[] = {
+    "initialize",
+    "finalize",
+    "read-file",
+    "object-create",
+    "object-reuse",
+    "object-destroy",
+    "find-init",
+    "find-match",
+    "find-done",
+    "attr-fetch",
+    "login",
+    "crypto-init",
+};
+
+typedef struct pemTraceRecordStr {
+    PRIntervalTime  time;
+    PRUint32        event;
+    PRUword         thread;
+    PRUint64        arg1;
+    PRUint64        arg2;
+} pemTraceRecord;
+
+PRUint32 pem_traceMask = 0;
+
+static pemTraceRecord *pem_traceRing = NULL;
+static PRInt32 pem_traceNext = 0;
+static PRFileDesc *pem_traceFd = NULL;
+
+static PRUint32
+pem_ParseTraceCategories(const char *spec)
+{
+    PRUint32 mask = 0;
+
+    while (spec && *spec) {
+        size_t len = strcspn(spec, ", ");
+        size_t i;
+
+        for (i = 0; i < NSS_PEM_ARRAY_SIZE(pem_traceCategories); i++) {
+            if (strlen(pem_traceCategories[i].name) == len
+                    && !strncmp(pem_traceCategories[i].name, spec, len))
+                mask |= pem_traceCategories[i].mask;
+        }
+
+        spec += len;
+        spec += strspn(spec, ", ");
+    }
+
+    return mask;
+}
+
+/* copy of the value of the environment variable name, for NSS_ZFreeIf */
+static char *
+pem_GetEnvCopy(const char *name)
+{
+    const char *value = PR_GetEnv(name);
+    char *copy;
+
+    if (!value || !*value)
+        return NULL;
+
+    copy = NSS_ZAlloc(NULL, strlen(value) + 1);
+    if (copy)
+        strcpy(copy, value);
+    return copy;
+}
+
+/* params are the module parameters, may be NULL */
+void open_nss_pem_log(const char *params)
+{
+    char *spec = pem_GetParameter(params, "trace");
+    char *file;
+
+    if (!spec)
+        spec = pem_GetEnvCopy("NSS_PEM_TRACE");
+
+    file = pem_GetParameter(params, "tracefile");
+    if (!file)
+        file = pem_GetEnvCopy("NSS_PEM_TRACE_FILE");
+    if (!file)
+        file = pem_GetEnvCopy("NSPR_LOG_FILE");
+
+#ifdef DEBUG
+    pem_traceMask = PEM_TRACE_LOG;
+#endif
+    if (spec)
+        pem_traceMask = pem_ParseTraceCategories(spec);
+    NSS_ZFreeIf(spec);
+
+    if ((pem_traceMask & ~PEM_TRACE_LOG) && !pem_traceRing) {
+        pem_traceRing = PR_Calloc(PEM_TRACE_RING_SIZE,
+                                  sizeof(pemTraceRecord));
+        if (!pem_traceRing)
+            pem_traceMask &= PEM_TRACE_LOG;
+    }
+
+    /* never log into a file that was not asked for */
+    if (pem_traceMask && file && !pem_traceFd)
+        pem_traceFd = PR_Open(file, PR_WRONLY | PR_CREATE_FILE | PR_APPEND,
+                              0600);
+    if (!pem_traceFd)
+        pem_traceMask &= ~PEM_TRACE_LOG;
+    NSS_ZFreeIf(file);
+}
+
+void pem_LogPrint(const char *fmt, ...)
+{
+    char buf[LOGGING_BUFFER_SIZE];
+    va_list ap;
+
+    if (!pem_traceFd)
+        return;
+
+    va_start(ap, fmt);
+    PR_vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    PR_Write(pem_traceFd, buf, strlen(buf));
+}
+
+void pem_TraceEvent(pemTraceEvent event, PRUint64 arg1, PRUint64 arg2)
+{
+    pemTraceRecord *rec;
+    PRUint32 i;
+
+    if (!pem_traceRing)
+        return;
+
+    i = (PRUint32) PR_ATOMIC_INCREMENT(&pem_traceNext) - 1;
+    rec = &pem_traceRing[i & (PEM_TRACE_RING_SIZE - 1)];
+    rec->time = PR_IntervalNow();
+    rec->event = event;
+    rec->thread = (PRUword) PR_GetCurrentThread();
+    rec->arg1 = arg1;
+    rec->arg2 = arg2;
+}
+
+/* size of the buffer needed by pem_TraceReport() */
+PRUint32 pem_TraceReportSize(void)
+{
+    if (!pem_traceRing)
+        return 0;
+
+    /* two header lines and the records */
+    return (2 + PEM_TRACE_RING_SIZE) * PEM_TRACE_LINE_LEN;
+}
+
+/*
+ * Format the content of the ring buffer as text into buf, oldest first.
+ * Returns the length of the text, which is not NUL terminated.
+ */
+PRUint32 pem_TraceReport(char *buf, PRUint32 size)
+{
+    PRUint32 next = (PRUint32) pem_traceNext;
+    PRUint32 i = 0;
+    PRUint32 len = 0;
+
+    if (!pem_traceRing || !size)
+        return 0;
+
+    if (next > PEM_TRACE_RING_SIZE)
+        i = next - PEM_TRACE_RING_SIZE;
+
+    len += PR_snprintf(buf + len, size - len,
+                       "# nss-pem trace: %u events, %u dropped\n", next, i);
+    len += PR_snprintf(buf + len, size - len,
+                       "# time_us thread event arg1 arg2\n");
+    for (; i < next && len + 1 < size; i++) {
+        const pemTraceRecord *rec =
+            &pem_traceRing[i & (PEM_TRACE_RING_SIZE - 1)];
+        const char *name = "unknown";
+
+        if (rec->event < NSS_PEM_ARRAY_SIZE(pem_traceEventNames))
+            name = pem_traceEventNames[rec->event];
+
+        len += PR_snprintf(buf + len, size - len, "%u %p %s %llu %llu\n",
+                           PR_IntervalToMicroseconds(rec->time),
+                           (void *) rec->thread, name, rec->arg1, rec->arg2);
+    }
+    return len;
+}
+
+/* write the content of the ring buffer as text into fd */
+void pem_TraceDump(PRFileDesc *fd)
+{
+    PRUint32 size = pem_TraceReportSize();
+    char *buf;
+
+    if (!size)
+        return;
+
+    buf = PR_Malloc(size);
+    if (buf) {
+        PR_Write(fd, buf, pem_TraceReport(buf, size));
+        PR_Free(buf);
+    }
+}
+
+/* dump the recorded events if asked to and stop tracing */
+void close_nss_pem_log()
+{
+    if (pem_traceFd) {
+        pem_TraceDump(pem_traceFd);
+        PR_Close(pem_traceFd);
+        pem_traceFd = NULL;
+    }
+
+    pem_traceMask = 0;
+    PR_Free(pem_traceRing);
+    pem_traceRing = NULL;
+    pem_traceNext = 0;
+}
@@ -40,6 +40,7 @@
 #include "ckpem.h"
 
 #include <base64.h>
+#include <blapi.h>
 #include <cryptohi.h>
 #include <nspr.h>
 #include <nssb64.h>
@@ -48,7 +49,8 @@
 #include <secitem.h>
 #include <secpkcs7.h>
 
-#include <stdarg.h>
+#include <sys/stat.h>
+
 
 static int put_object(SECItem *der, SECItem ***derlist, int *count)
 {
@@ -66,40 +68,6 @@ static int put_object(SECItem *der, SECItem ***derlist, int *count)
     return 0;
 }
 
-static SECStatus FileToItem(SECItem * dst, PRFileDesc * src)
-{
-    static const PRInt32 chunk = 65536;
-    PRInt32 bytesReadTotal = 0;
-
-    for (;;) {
-	PRInt32 bytesReadNow;
-	PRInt32 newSize = bytesReadTotal + chunk;
-	if (newSize < chunk)
-	    /* int overflow */
-	    break;
-
-	if (SECITEM_ReallocItemV2(NULL, dst, newSize) != SECSuccess)
-	    /* out of memory */
-	    break;
-
-	bytesReadNow = PR_Read(src, dst->data + bytesReadTotal, chunk);
-	if (bytesReadNow < 0)
-	    /* read error */
-	    break;
-
-	if (bytesReadNow == 0) {
-	    /* EOF */
-	    dst->len = bytesReadTotal;
-	    return SECSuccess;
-	}
-
-	bytesReadTotal += bytesReadNow;
-    }
-
-    free(dst->data);
-    return SECFailure;
-}
-
 static SECStatus ConvertAsciiToZAllocItem(SECItem *der, const char *ascii)
 {
     SECStatus rv = SECFailure;
@@ -119,42 +87,167 @@ static SECStatus ConvertAsciiToZAllocItem(SECItem *der, const char *ascii)
 	memcpy(der->data, tmp.data, tmp.len);
 	der->len = tmp.len;
     }
-    SECITEM_FreeItem(&tmp, PR_FALSE);
+    /* the decoded data may be a private key, wipe it */
+    SECITEM_ZfreeItem(&tmp, PR_FALSE);
     return rv;
 }
 
-/* returns count of objects read, or -1 on error */
-int ReadDERFromFile(SECItem *** derlist, char *filename, int *cipher,
-		    char **ivstring, PRBool certsonly)
+/* release the data of der unless it is borrowed from a snapshot */
+static void FreeDERItem(SECItem * der)
 {
-    SECStatus rv;
-    PRFileDesc *inFile;
-    int count = 0;
-    SECItem *der = NULL;
-    int error;
-    SECItem filedata;
-    char *c, *iv;
+    if (!pem_SnapshotOwns(der->data))
+	NSS_ZFreeIf(der->data);
+    der->data = NULL;
+}
 
-    memset(&filedata, 0, sizeof filedata);
+/* release a list returned by ReadDERFromFile(), wiping keys */
+void FreeDERList(SECItem ** derlist, int count)
+{
+    int i;
 
-    inFile = PR_Open(filename, PR_RDONLY, 0);
-    if (!inFile)
-	return -1;
+    if (!derlist)
+	return;
+    for (i = 0; i < count; i++) {
+	FreeDERItem(derlist[i]);
+	NSS_ZFreeIf(derlist[i]);
+    }
+    NSS_ZFreeIf(derlist);
+}
 
-    /* First convert ascii to binary */
-    char *asc, *body;
+/*
+ * Decoded contents of PEM files, cached while the configuration is loaded
+ * (see pem_FileCacheBegin()) so that a file referenced several times, e.g. a
+ * CA bundle used in several slots or a certificate file that also holds the
+ * key, is read and decoded only once.  Files are identified by device, inode,
+ * size and modification time.  The cache holds private keys, it is wiped by
+ * pem_FileCacheEnd() as soon as the configuration is loaded.
+ */
+#define PEM_BLOCK_CERT	0x1
+#define PEM_BLOCK_KEY	0x2
+
+#define PEM_FILE_BUCKETS 256
+#define PEM_PREFETCH_THREADS 8
+
+typedef struct pemFileBlockStr {
+    SECItem	der;
+    int		kind;		/* PEM_BLOCK_* */
+} pemFileBlock;
+
+typedef struct pemFileStr {
+    dev_t	dev;
+    ino_t	ino;
+    off_t	size;
+    time_t	mtime;
+    pemFileBlock *blocks;
+    int		count;
+    int		cipher;		/* of the (last) key */
+    char	*ivstring;
+    PRFileInfo64 info;
+    unsigned char digest[SHA256_LENGTH];	/* of the contents */
+    PRBool	hasDigest;
+    PRBool	fresh;		/* prefetched, not used yet */
+    struct pemFileStr *next;
+} pemFile;
+
+static pemFile *pem_fileBuckets[PEM_FILE_BUCKETS];
+static PRBool pem_fileCacheActive = PR_FALSE;
+
+static unsigned int FileBucket(dev_t dev, ino_t ino)
+{
+    return ((unsigned int) ino * 2654435761U ^ (unsigned int) dev)
+	% PEM_FILE_BUCKETS;
+}
 
-    /* Read in ascii data */
-    rv = FileToItem(&filedata, inFile);
-    if (rv != SECSuccess) {
-	PR_Close(inFile);
-	return -1;
+static PRBool FileMatches(const pemFile *file, const struct stat *st)
+{
+    return file->dev == st->st_dev && file->ino == st->st_ino
+	&& file->size == st->st_size && file->mtime == st->st_mtime;
+}
+
+/* wipe and release the decoded contents of a file */
+static void FreeFile(pemFile *file)
+{
+    int i;
+
+    for (i = 0; i < file->count; i++)
+	NSS_ZFreeIf(file->blocks[i].der.data);
+    NSS_ZFreeIf(file->blocks);
+    if (file->ivstring)
+	PORT_ZFree(file->ivstring, strlen(file->ivstring));
+    NSS_ZFreeIf(file);
+}
+
+static SECStatus AddBlock(pemFile *file, SECItem *der, int kind)
+{
+    pemFileBlock *blocks;
+
+    blocks = NSS_ZNEWARRAY(NULL, pemFileBlock, file->count + 1);
+    if (!blocks)
+	return SECFailure;
+    if (file->blocks)
+	memcpy(blocks, file->blocks, file->count * sizeof *blocks);
+    NSS_ZFreeIf(file->blocks);
+
+    blocks[file->count].der = *der;
+    blocks[file->count].kind = kind;
+    file->blocks = blocks;
+    file->count++;
+    der->data = NULL;
+    der->len = 0;
+    return SECSuccess;
+}
+
+/*
+ * Tell a DER encoded certificate from a DER encoded private key (PKCS #8 or
+ * PKCS #1) by the first element of the outer SEQUENCE, which has to span
+ * exactly len bytes.  Returns PEM_BLOCK_CERT, PEM_BLOCK_KEY or 0 if der is
+ * neither.
+ */
+static int SniffDER(const unsigned char *der, unsigned int len)
+{
+    unsigned int hdr, n, i;
+
+    if (len < 2 || der[0] != 0x30)
+	return 0;
+
+    /* the length of the outer SEQUENCE */
+    if (der[1] < 0x80) {
+	n = der[1];
+	hdr = 2;
+    } else {
+	hdr = 2 + (der[1] & 0x7f);
+	if (hdr == 2 || hdr > 6 || len < hdr)
+	    return 0;
+	for (n = 0, i = 2; i < hdr; i++)
+	    n = (n << 8) | der[i];
     }
-    asc = (char *) filedata.data;
-    if (!asc) {
-	PR_Close(inFile);
-	return -1;
+    if (n != len - hdr || n < 2)
+	return 0;
+
+    switch (der[hdr]) {
+    case 0x02:
+	/* version of RSAPrivateKey or PrivateKeyInfo */
+	return PEM_BLOCK_KEY;
+    case 0x30:
+	/* TBSCertificate starts with an explicit version or the serial,
+	 * unlike EncryptedPrivateKeyInfo, which is not supported */
+	i = hdr + ((der[hdr + 1] < 0x80) ? 2 : 2 + (der[hdr + 1] & 0x7f));
+	if (i < len && (der[i] == 0xa0 || der[i] == 0x02))
+	    return PEM_BLOCK_CERT;
+	break;
     }
+    return 0;
+}
+
+/* decode all certificates and keys of the PEM file asc */
+static SECStatus DecodeFile(pemFile *file, char *asc)
+{
+    SECItem der;
+    char *c, *iv, *body;
+    SECStatus rv;
+    int kind;
+
+    memset(&der, 0, sizeof der);
 
     /* check for headers and trailers and remove them */
     if (strstr(asc, "-----BEGIN") != NULL) {
@@ -167,45 +260,44 @@ int ReadDERFromFile(SECItem *** derlist, char *filename, int *cipher,
 		c = body;
 		body = strchr(body, '\n');
 		if (NULL == body)
-		    goto loser;
+		    return SECFailure;
 		body++;
 		if (strncmp(body, "Proc-Type: 4,ENCRYPTED", 22) == 0) {
 		    body = strchr(body, '\n');
 		    if (NULL == body)
-			goto loser;
+			return SECFailure;
 		    body++;
 		    if (strncmp(body, "DEK-Info: ", 10) == 0) {
 			body += 10;
 			c = body;
 			body = strchr(body, ',');
 			if (body == NULL)
-			    goto loser;
+			    return SECFailure;
 			*body = '\0';
 			if (!strcasecmp(c, "DES-EDE3-CBC"))
-			    *cipher = NSS_DES_EDE3_CBC;
+			    file->cipher = NSS_DES_EDE3_CBC;
 			else if (!strcasecmp(c, "DES-CBC"))
-			    *cipher = NSS_DES_CBC;
+			    file->cipher = NSS_DES_CBC;
 			else {
-			    *cipher = -1;
-			    goto loser;
+			    file->cipher = -1;
+			    return SECFailure;
 			}
 			body++;
 			iv = body;
 			body = strchr(body, '\n');
 			if (body == NULL)
-			    goto loser;
+			    return SECFailure;
 			*body = '\0';
 			body++;
-			*ivstring = PORT_Strdup(iv);
+			if (file->ivstring)
+			    PORT_ZFree(file->ivstring, strlen(file->ivstring));
+			file->ivstring = PORT_Strdup(iv);
 		    }
 		} else {	/* Else the private key is not encrypted */
-		    *cipher = 0;
+		    file->cipher = 0;
 		    body = c;
 		}
 	    }
-	    der = NSS_ZAlloc(NULL, sizeof(SECItem));
-	    if (der == NULL)
-		goto loser;
 
 	    char *trailer = NULL;
 	    asc = body;
@@ -219,87 +311,380 @@ int ReadDERFromFile(SECItem *** derlist, char *filename, int *cipher,
 		asc = trailer + 1;
 		*trailer = '\0';
 	    } else {
-		goto loser;
+		return SECFailure;
 	    }
 
 	    /* Convert to binary */
-	    rv = ConvertAsciiToZAllocItem(der, body);
-	    if (rv) {
-		goto loser;
-	    }
-	    if ((certsonly && !key) || (!certsonly && key)) {
-		error = put_object(der, derlist, &count);
-		if (error) {
-		    goto loser;
-		}
-		der = NULL;
-	    } else {
-		NSS_ZFreeIf(der->data);
-		NSS_ZFreeIf(der);
-		der = NULL;
+	    rv = ConvertAsciiToZAllocItem(&der, body);
+	    if (rv)
+		return SECFailure;
+	    if (AddBlock(file, &der, key ? PEM_BLOCK_KEY : PEM_BLOCK_CERT)) {
+		NSS_ZFreeIf(der.data);
+		return SECFailure;
 	    }
 	}			/* while */
-    } else {		/* No headers and footers, translate the blob */
-	der = NSS_ZAlloc(NULL, sizeof(SECItem));
-	if (der == NULL)
-	    goto loser;
+    } else {		/* No headers and footers, base64 encoded DER */
+	rv = ConvertAsciiToZAllocItem(&der, asc);
+	if (rv)
+	    return SECFailure;
+	kind = SniffDER(der.data, der.len);
+	if (!kind || AddBlock(file, &der, kind)) {
+	    NSS_ZFreeIf(der.data);
+	    return SECFailure;
+	}
+    }
+
+    return SECSuccess;
+}
+
+/*
+ * Add the certificates and keys of data, binary DER or PEM, to file.  The
+ * data has to be NUL terminated and allocated by NSS_ZAlloc(), it is
+ * consumed.
+ */
+static SECStatus DecodeData(pemFile *file, SECItem *data)
+{
+    SECStatus rv;
+    int kind;
+
+    kind = SniffDER(data->data, data->len);
+    if (kind) {
+	/* binary DER, the data is the certificate or key as is */
+	rv = AddBlock(file, data, kind);
+    } else {
+	rv = DecodeFile(file, (char *) data->data);
+    }
+
+    /* NSS_ZFreeIf() wipes the data, it may contain a private key */
+    NSS_ZFreeIf(data->data);
+    data->data = NULL;
+    data->len = 0;
+    return rv;
+}
+
+/*
+ * Read and decode filename; info is set to its size and mtime as read.  If
+ * src is given, the digest of the contents is kept for a snapshot, taken
+ * over from src when that was computed for the same size and mtime.
+ */
+static pemFile *ReadFile(const char *filename, const struct stat *st,
+			 PRFileInfo64 *info, const pemSrcDigest *src)
+{
+    PRFileDesc *inFile;
+    SECItem filedata;
+    pemFile *file;
+
+    file = NSS_ZNEW(NULL, pemFile);
+    if (!file)
+	return NULL;
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+    file->size = st->st_size;
+    file->mtime = st->st_mtime;
+
+    inFile = PR_Open(filename, PR_RDONLY, 0);
+    if (!inFile) {
+	NSS_ZFreeIf(file);
+	return NULL;
+    }
 
-	rv = ConvertAsciiToZAllocItem(der, asc);
-	if (rv) {
+    /* read the file exactly, terminated for the PEM scanner */
+    memset(&filedata, 0, sizeof filedata);
+    if (PR_GetOpenFileInfo64(inFile, info) != PR_SUCCESS
+	    || info->size < 0 || info->size >= PR_INT32_MAX
+	    || !(filedata.data = NSS_ZAlloc(NULL, info->size + 1))) {
+	PR_Close(inFile);
+	NSS_ZFreeIf(file);
+	return NULL;
+    }
+    while (filedata.len < (unsigned int) info->size) {
+	PRInt32 n = PR_Read(inFile, filedata.data + filedata.len,
+			    info->size - filedata.len);
+	if (n <= 0)
+	    break;
+	filedata.len += n;
+    }
+    PR_Close(inFile);
+    filedata.data[filedata.len] = '\0';
+    file->info = *info;
+
+    /* snapshots are validated against exactly what is decoded here */
+    if (src && src->valid && src->info.size == info->size
+	    && src->info.modifyTime == info->modifyTime) {
+	memcpy(file->digest, src->digest, sizeof file->digest);
+	file->hasDigest = PR_TRUE;
+    } else if (src) {
+	file->hasDigest = (SECSuccess == SHA256_HashBuf(file->digest,
+							filedata.data,
+							filedata.len));
+    }
+
+    if (DecodeData(file, &filedata) != SECSuccess) {
+	FreeFile(file);
+	return NULL;
+    }
+    return file;
+}
+
+/* copy the blocks of the given kind out of file, or move them if the file
+ * is not kept in the cache */
+static int CopyBlocks(pemFile *file, SECItem ***derlist, int kind,
+		      PRBool move)
+{
+    SECItem *der;
+    int count = 0;
+    int i;
+
+    for (i = 0; i < file->count; i++) {
+	SECItem *src = &file->blocks[i].der;
+
+	if (!(file->blocks[i].kind & kind))
+	    continue;
+
+	der = NSS_ZNEW(NULL, SECItem);
+	if (!der)
 	    goto loser;
+	if (move) {
+	    *der = *src;
+	    src->data = NULL;
+	    src->len = 0;
+	} else {
+	    der->data = NSS_ZAlloc(NULL, src->len);
+	    if (!der->data) {
+		NSS_ZFreeIf(der);
+		goto loser;
+	    }
+	    memcpy(der->data, src->data, src->len);
+	    der->len = src->len;
 	}
-	/* NOTE: This code path has never been tested. */
-	error = put_object(der, derlist, &count);
-	if (error) {
+
+	if (put_object(der, derlist, &count)) {
+	    NSS_ZFreeIf(der->data);
+	    NSS_ZFreeIf(der);
 	    goto loser;
 	}
-	der = NULL;
     }
-
-    free(filedata.data);
-    PR_Close(inFile);
     return count;
 
   loser:
-    free(filedata.data);
-    if (der) {
-	NSS_ZFreeIf(der->data);
-	NSS_ZFreeIf(der);
-    }
-    PR_Close(inFile);
+    FreeDERList(*derlist, count);
+    *derlist = NULL;
     return -1;
 }
 
-#ifdef DEBUG
-#define LOGGING_BUFFER_SIZE 400
-#define PEM_DEFAULT_LOG_FILE "/tmp/pkcs11.log"
-static const char *pemLogModuleName = "PEM";
-static PRLogModuleInfo* pemLogModule = NULL;
-#endif
+/* start caching decoded files, see pem_FileCacheEnd() */
+void pem_FileCacheBegin(void)
+{
+    pem_fileCacheActive = PR_TRUE;
+}
 
-void open_nss_pem_log()
+/* stop caching decoded files and wipe the cache */
+void pem_FileCacheEnd(void)
 {
-#ifdef DEBUG
-    const char *nsprLogFile = PR_GetEnv("NSPR_LOG_FILE");
+    int i;
 
-    if (!pemLogModule) {
-        pemLogModule = PR_NewLogModule(pemLogModuleName);
+    for (i = 0; i < PEM_FILE_BUCKETS; i++) {
+	while (pem_fileBuckets[i]) {
+	    pemFile *file = pem_fileBuckets[i];
+	    pem_fileBuckets[i] = file->next;
+	    FreeFile(file);
+	}
     }
+    pem_fileCacheActive = PR_FALSE;
+}
+
+typedef struct pemPrefetchStr {
+    const char	**names;
+    pemFile	**files;
+    PRInt32	count;
+    PRInt32	next;		/* next name to read, atomically incremented */
+} pemPrefetch;
 
-    (void) PR_SetLogFile(nsprLogFile ? nsprLogFile : PEM_DEFAULT_LOG_FILE);
-    /* If false, the log file will remain what it was before */
-#endif
+static void PrefetchFiles(void *arg)
+{
+    pemPrefetch *pf = arg;
+    PRInt32 i;
+
+    while ((i = PR_AtomicIncrement(&pf->next) - 1) < pf->count) {
+	PRFileInfo64 info;
+	struct stat st;
+
+	if (!stat(pf->names[i], &st))
+	    pf->files[i] = ReadFile(pf->names[i], &st, &info, NULL);
+    }
 }
 
-void plog(const char *fmt, ...)
+/*
+ * Read and decode the given files into the cache in parallel, so that the
+ * latency of the reads (cold or network storage) is paid about once instead
+ * of once per file.  The files are then handed out by ReadDERFromFile() as
+ * the configuration is processed; files that cannot be read here are simply
+ * read again (and fail) there.
+ */
+void pem_FilePrefetch(const char **names, int count)
 {
-#ifdef DEBUG
-    char buf[LOGGING_BUFFER_SIZE];
-    va_list ap;
-
-    va_start(ap, fmt);
-    PR_vsnprintf(buf, sizeof(buf), fmt, ap);
-    va_end(ap);
-    PR_LOG(pemLogModule, PR_LOG_DEBUG, ("%s", buf));
-#endif
+    PRThread *threads[PEM_PREFETCH_THREADS];
+    pemPrefetch pf;
+    int nthreads, i;
+
+    if (!pem_fileCacheActive || count < 2)
+	return;
+
+    pf.names = names;
+    pf.count = count;
+    pf.next = 0;
+    pf.files = NSS_ZNEWARRAY(NULL, pemFile *, count);
+    if (!pf.files)
+	return;
+
+    for (nthreads = 0; nthreads < PEM_PREFETCH_THREADS
+	    && nthreads < count; nthreads++) {
+	threads[nthreads] = PR_CreateThread(PR_USER_THREAD, PrefetchFiles, &pf,
+					    PR_PRIORITY_NORMAL,
+					    PR_GLOBAL_THREAD,
+					    PR_JOINABLE_THREAD, 0);
+	if (!threads[nthreads])
+	    break;
+    }
+    for (i = 0; i < nthreads; i++)
+	PR_JoinThread(threads[i]);
+
+    for (i = 0; i < count; i++) {
+	pemFile *file = pf.files[i], *cached;
+	unsigned int bucket;
+
+	if (!file)
+	    continue;
+
+	/* the same file may be configured more than once */
+	bucket = FileBucket(file->dev, file->ino);
+	for (cached = pem_fileBuckets[bucket]; cached; cached = cached->next) {
+	    if (cached->dev == file->dev && cached->ino == file->ino)
+		break;
+	}
+	if (cached) {
+	    FreeFile(file);
+	    continue;
+	}
+
+	file->fresh = PR_TRUE;
+	file->next = pem_fileBuckets[bucket];
+	pem_fileBuckets[bucket] = file;
+    }
+    NSS_ZFreeIf(pf.files);
+}
+
+/* returns count of objects read, or -1 on error; certificates may point
+ * into a snapshot (see psnap.c), release the list with FreeDERList() */
+int ReadDERFromFile(SECItem *** derlist, char *filename, int *cipher,
+		    char **ivstring, PRBool certsonly)
+{
+    PRFileInfo64 info;
+    pemSrcDigest src;
+    struct stat st;
+    pemFile *file = NULL;
+    PRBool decoded = PR_FALSE;
+    unsigned int bucket;
+    int count;
+
+    if (certsonly && pem_SnapshotEnabled()) {
+	/* certificates might have been decoded by a previous run already */
+	count = pem_SnapshotLoad(derlist, filename, &src);
+	if (count >= 0)
+	    return count;
+    }
+
+    if (stat(filename, &st))
+	return -1;
+
+    bucket = FileBucket(st.st_dev, st.st_ino);
+    if (pem_fileCacheActive) {
+	for (file = pem_fileBuckets[bucket]; file; file = file->next) {
+	    if (FileMatches(file, &st))
+		break;
+	}
+	if (file && file->fresh) {
+	    /* read by pem_FilePrefetch(), used for the first time */
+	    pem_Trace(PEM_TRACE_IO, pemTraceReadFile, certsonly, file->count);
+	    decoded = PR_TRUE;
+	    info = file->info;
+	    file->fresh = PR_FALSE;
+	}
+    }
+
+    if (!file) {
+	file = ReadFile(filename, &st, &info,
+			(certsonly && pem_SnapshotEnabled()) ? &src : NULL);
+	if (!file)
+	    return -1;
+	decoded = PR_TRUE;
+	pem_Trace(PEM_TRACE_IO, pemTraceReadFile, certsonly, file->count);
+
+	if (pem_fileCacheActive) {
+	    file->next = pem_fileBuckets[bucket];
+	    pem_fileBuckets[bucket] = file;
+	}
+    }
+
+    count = CopyBlocks(file, derlist,
+		       certsonly ? PEM_BLOCK_CERT : PEM_BLOCK_KEY,
+		       !pem_fileCacheActive);
+    if (count > 0 && !certsonly) {
+	*cipher = file->cipher;
+	if (file->ivstring)
+	    *ivstring = PORT_Strdup(file->ivstring);
+    }
+
+    if (decoded && certsonly)
+	pem_SnapshotStore(*derlist, count, filename, &info,
+			  file->hasDigest ? file->digest : NULL);
+    if (!pem_fileCacheActive)
+	FreeFile(file);
+
+    return count;
+}
+
+/*
+ * Like ReadDERFromFile(), but for the contents of a PEM or DER file given
+ * in memory, e.g. as CKA_VALUE of C_CreateObject().
+ */
+int pem_ReadDERFromBuffer(SECItem *** derlist, const unsigned char *buf,
+			  unsigned int len, int *cipher, char **ivstring,
+			  PRBool certsonly)
+{
+    SECItem data;
+    pemFile *file;
+    int count;
+
+    if (!buf || !len || len >= PR_INT32_MAX)
+	return -1;
+
+    file = NSS_ZNEW(NULL, pemFile);
+    if (!file)
+	return -1;
+
+    /* the PEM scanner needs a terminated copy of the caller's data */
+    data.data = NSS_ZAlloc(NULL, len + 1);
+    if (!data.data) {
+	NSS_ZFreeIf(file);
+	return -1;
+    }
+    memcpy(data.data, buf, len);
+    data.len = len;
+
+    if (DecodeData(file, &data) != SECSuccess) {
+	FreeFile(file);
+	return -1;
+    }
+
+    count = CopyBlocks(file, derlist,
+		       certsonly ? PEM_BLOCK_CERT : PEM_BLOCK_KEY, PR_TRUE);
+    if (count > 0 && !certsonly) {
+	*cipher = file->cipher;
+	if (file->ivstring)
+	    *ivstring = PORT_Strdup(file->ivstring);
+    }
+    FreeFile(file);
+
+    return count;
 }